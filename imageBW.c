@@ -24,9 +24,16 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "instrumentation.h"
 
@@ -44,13 +51,31 @@
 // Constant value --- Use them throughout your code
 // const uint8 BLACK = 1;  // Black pixel value, defined on .h
 // const uint8 WHITE = 0;  // White pixel value, defined on .h
-const int EOR = -1;  // Stored as the last element of a RLE row
+
+// Elements of RLE row arrays: the color of the first run, the run lengths
+// and EOR.  Unsigned 32-bit, so that a run may span a whole row of any
+// width below UINT32_MAX (the value of EOR).
+typedef uint32 RLEElem;
+const RLEElem EOR = UINT32_MAX;  // Stored as the last element of a RLE row
 
 // Internal structure for storing RLE BW images
 struct image {
   uint32 width;
   uint32 height;
-  int** row;  // pointer to an array of pointers referencing the compressed rows
+  RLEElem** row;  // pointer to an array of pointers referencing the compressed rows
+  // Tiled images split each row into num_tiles column tiles of tile_width
+  // pixels (the last one may be narrower), each one a RLE row of its own:
+  // tile t of row i is row[i * num_tiles + t].
+  // Untiled images have a single tile per row (num_tiles == 1).
+  uint32 tile_width;
+  uint32 num_tiles;
+  void* map;        // file mapping holding the rows (NULL if rows are owned)
+  size_t map_size;  // size of the mapping
+  // Procedural images store no rows (row == NULL): each row is produced
+  // on demand by gen, from the row index and the parameters in param.
+  uint32 (*gen)(const struct image* img, uint32 i, RLEElem* RLE_row);
+  uint32 param[6];
+  int invert;       // generated rows are negated (1) or not (0)
 };
 
 // This module follows "design-by-contract" principles.
@@ -76,65 +101,232 @@ static void check(int condition, const char* failmsg) {
 }
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of counters.
+/// (Instrumentation is calibrated lazily, by InstrPrint.)
 void ImageInit(void) {  ///
-  InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "allocs";  // InstrCount[1] will count allocation calls
+  InstrName[2] = "memlive"; // InstrCount[2] will hold bytes currently in use
+  InstrName[3] = "mempeak"; // InstrCount[3] will hold peak bytes since reset
   // Name other counters here...
 }
 
 // Macros to simplify accessing instrumentation counters:
 #define PIXMEM InstrCount[0]
+#define ALLOCS InstrCount[1]
+#define MEMLIVE InstrCount[2]
+#define MEMPEAK InstrCount[3]
 // Add more macros here...
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// Counters are updated through InstrAdd, so that a build with NINSTR
+// defined (make prod) has no counting code at all.  Loops sum their
+// counts in a local variable and add them once, after the loop.
+#define COUNT_PIXMEM(n) InstrAdd(0, n)
+
+// TIP: Search for COUNT_PIXMEM or InstrCount to see where it is incremented!
+
+/// Tracked memory allocation
+
+// Every block of memory used by this module goes through ImageMalloc and
+// ImageFree.  Each block is preceded by a small header recording its size,
+// so that we can keep track of the number of bytes currently in use.
+// MEMLIVE and MEMPEAK are refreshed on every allocation and release;
+// right after InstrReset() they read 0 until the next one.
+// The byte count is shared by all threads, so it is updated atomically;
+// the counters are per thread, and count the allocations of that thread.
+//
+// While a region is the current allocation context of a thread (see
+// ImageRegionBegin), the blocks it allocates are carved from large chunks
+// owned by the region instead: ImageFree ignores them, and they are all
+// released at once by ImageRegionEnd.  The header of each block records
+// its region (NULL for heap blocks).  For region blocks, ALLOCS counts the
+// chunks, and the byte counters count whole chunks.
+
+typedef union {
+  struct {
+    size_t size;        // bytes requested
+    ImageRegion region; // region holding the block (NULL: heap block)
+  };
+  max_align_t align;  // keeps the user part of the block properly aligned
+} BlockHeader;
+
+// Chunks of a region, each one followed by the blocks carved from it.
+typedef union RegionChunk {
+  struct {
+    union RegionChunk* next;  // older chunk
+    size_t size;              // bytes, including this header
+  };
+  max_align_t align;
+} RegionChunk;
+
+// File mappings of region images, unmapped when the region ends.
+typedef struct RegionMap {
+  void* map;
+  size_t size;
+  struct RegionMap* next;
+} RegionMap;
+
+struct imageRegion {
+  ImageRegion parent;   // current region when this one began (NULL: heap)
+  RegionChunk* chunks;  // chunks, newest first
+  char* free;           // unused part of the newest chunk: [free, end)
+  char* end;
+  size_t chunk_size;    // size of the next chunk
+  RegionMap* maps;
+};
+
+#define REGION_CHUNK_MIN ((size_t)64 << 10)
+#define REGION_CHUNK_MAX ((size_t)16 << 20)
+
+static _Thread_local ImageRegion current_region = NULL;
+
+#ifndef NINSTR
+static atomic_size_t mem_live = 0;  // bytes currently allocated (never reset)
+
+/// Account for size more bytes in use
+static void CountAlloc(size_t size) {
+  ALLOCS++;
+  MEMLIVE = atomic_fetch_add(&mem_live, size) + size;
+  if (MEMLIVE > MEMPEAK) MEMPEAK = MEMLIVE;
+}
+
+/// Account for size bytes released
+static void CountFree(size_t size) {
+  MEMLIVE = atomic_fetch_sub(&mem_live, size) - size;
+}
+#else
+#define CountAlloc(size) ((void)sizeof(size))
+#define CountFree(size) ((void)sizeof(size))
+#endif
+
+/// Allocate size bytes from the heap, whatever the current region
+static void* HeapMalloc(size_t size) {
+  BlockHeader* block = malloc(sizeof(BlockHeader) + size);
+  check(block != NULL, "malloc");
+  block->size = size;
+  block->region = NULL;
+  CountAlloc(size);
+
+  return block + 1;
+}
+
+/// Add a chunk with room for at least need bytes to region r.
+/// Chunks grow geometrically.  A block too large for the next chunk gets
+/// a chunk of its own, behind the newest one, whose free part is kept.
+static void* AddRegionChunk(ImageRegion r, size_t need) {
+  size_t size = sizeof(RegionChunk) + need;
+  int own = size > r->chunk_size / 4;
+  if (!own) size = r->chunk_size;
+  if (r->chunk_size < REGION_CHUNK_MAX) r->chunk_size *= 2;
+
+  RegionChunk* chunk = malloc(size);
+  check(chunk != NULL, "malloc");
+  chunk->size = size;
+  CountAlloc(size);
+
+  char* start = (char*)(chunk + 1);
+  if (own && r->chunks != NULL) {
+    chunk->next = r->chunks->next;
+    r->chunks->next = chunk;
+  } else {
+    chunk->next = r->chunks;
+    r->chunks = chunk;
+    r->free = start + need;
+    r->end = (char*)chunk + size;
+  }
+  return start;
+}
+
+/// Allocate size bytes from region r
+static void* RegionMalloc(ImageRegion r, size_t size) {
+  const size_t align = sizeof(BlockHeader);  // a multiple of max_align_t
+  size_t need = sizeof(BlockHeader) + (size + align - 1) / align * align;
+  BlockHeader* block;
+  if ((size_t)(r->end - r->free) >= need) {
+    block = (BlockHeader*)r->free;
+    r->free += need;
+  } else {
+    block = AddRegionChunk(r, need);
+  }
+  block->size = size;
+  block->region = r;
+
+  return block + 1;
+}
+
+/// Allocate size bytes, updating the memory counters
+static void* ImageMalloc(size_t size) {
+  ImageRegion r = current_region;
+  return r != NULL ? RegionMalloc(r, size) : HeapMalloc(size);
+}
+
+/// Release a block obtained from ImageMalloc (NULL is ignored).
+/// Region blocks are left for ImageRegionEnd.
+static void ImageFree(void* ptr) {
+  if (ptr == NULL) return;
+  BlockHeader* block = (BlockHeader*)ptr - 1;
+  if (block->region != NULL) return;
+
+  CountFree(block->size);
+
+  free(block);
+}
+
+/// Get the size of a block obtained from ImageMalloc
+static size_t ImageBlockSize(const void* ptr) {
+  return ((const BlockHeader*)ptr - 1)->size;
+}
+
+/// Get the region holding a block obtained from ImageMalloc (NULL: heap)
+static ImageRegion BlockRegion(const void* ptr) {
+  return ((const BlockHeader*)ptr - 1)->region;
+}
 
 /// Auxiliary (static) functions
 
-/// Create the header of an image data structure
-/// And allocate the array of pointers to RLE rows
-static Image AllocateImageHeader(uint32 width, uint32 height) {
-  assert(width > 0 && height > 0);
-  Image newHeader = malloc(sizeof(struct image));
-  check(newHeader != NULL, "malloc");
+/// Create the header of an image data structure, with rows split into
+/// tiles of tile_width pixels (untiled if tile_width >= width)
+/// And allocate the array of pointers to RLE rows (or tiles)
+static Image AllocateTiledImageHeader(uint32 width, uint32 height,
+                                      uint32 tile_width) {
+  assert(width > 0 && height > 0 && tile_width > 0);
+  assert(width < UINT32_MAX);  // runs must be smaller than EOR
+  Image newHeader = ImageMalloc(sizeof(struct image));
 
+  if (tile_width > width) tile_width = width;
   newHeader->width = width;
   newHeader->height = height;
-
-  // Allocating the array of pointers to RLE rows
-  newHeader->row = malloc(height * sizeof(int*));
-  check(newHeader->row != NULL, "malloc");
+  newHeader->tile_width = tile_width;
+  newHeader->num_tiles = width / tile_width + (width % tile_width != 0);
+  newHeader->map = NULL;
+  newHeader->map_size = 0;
+  newHeader->gen = NULL;
+  newHeader->invert = 0;
+
+  // Allocating the array of pointers to RLE rows (initially NULL)
+  size_t num_rows = (size_t)height * newHeader->num_tiles;
+  newHeader->row = ImageMalloc(num_rows * sizeof(RLEElem*));
+  memset(newHeader->row, 0, num_rows * sizeof(RLEElem*));
 
   return newHeader;
 }
 
+/// Create the header of an (untiled) image data structure
+/// And allocate the array of pointers to RLE rows
+static Image AllocateImageHeader(uint32 width, uint32 height) {
+  return AllocateTiledImageHeader(width, height, width);
+}
+
 /// Allocate an array to store a RLE row with n elements
-static int* AllocateRLERowArray(uint32 n) {
+static RLEElem* AllocateRLERowArray(uint32 n) {
   assert(n > 2);
-  int* newArray = malloc(n * sizeof(int));
-  check(newArray != NULL, "malloc");
+  RLEElem* newArray = ImageMalloc(n * sizeof(RLEElem));
 
   return newArray;
 }
 
-/// Compute the number of runs of a non-compressed (RAW) image row
-static uint32 GetNumRunsInRAWRow(uint32 image_width, const uint8* RAW_row) {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
-
-  // How many runs?
-  uint32 num_runs = 1;
-  for (uint32 i = 1; i < image_width; i++) {
-    if (RAW_row[i] != RAW_row[i - 1]) {
-      num_runs++;
-    }
-  }
-
-  return num_runs;
-}
-
 /// Get the number of runs of a compressed RLE image row
-static uint32 GetNumRunsInRLERow(const int* RLE_row) {
+static uint32 GetNumRunsInRLERow(const RLEElem* RLE_row) {
   assert(RLE_row != NULL);
 
   // Go through the RLE_row until EOR is found
@@ -151,7 +343,7 @@ static uint32 GetNumRunsInRLERow(const int* RLE_row) {
 }
 
 /// Get the number of elements of an array storing a compressed RLE image row
-static uint32 GetSizeRLERowArray(const int* RLE_row) {
+static uint32 GetSizeRLERowArray(const RLEElem* RLE_row) {
   assert(RLE_row != NULL);
 
   // Go through the array until EOR is found
@@ -163,59 +355,189 @@ static uint32 GetSizeRLERowArray(const int* RLE_row) {
   return (i + 1);
 }
 
-/// Compress into RLE format a RAW image row
-/// Allocates and returns the array storing the image row in RLE format
-static int* CompressRow(uint32 image_width, const uint8* RAW_row) {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
+/// Scratch buffers
+
+// Row operations need temporary worst-case sized RLE rows and byte buffers.
+// Instead of allocating them for every row, they come from a small
+// per-thread arena of buffers that only grow.  In steady state, row
+// conversions do not touch the allocator at all.
+// Each kind of use has its own slot, so that buffers in use at the
+// same time never overlap.
+
+enum {
+  SCRATCH_RLE,                 // RLE rows being built
+  SCRATCH_ROW1, SCRATCH_ROW2,  // generated rows of operands (see GetRow)
+  SCRATCH_TILE,                // tiles being stored (see StoreRow)
+  SCRATCH_BYTES,               // packed PBM bytes
+  NUM_SCRATCH
+};
+
+static _Thread_local struct {
+  void* buf;
+  size_t size;
+} scratch[NUM_SCRATCH];
+
+/// Get scratch buffer number slot, with room for at least size bytes.
+/// The contents are not preserved when the buffer grows.
+static void* Scratch(int slot, size_t size) {
+  if (scratch[slot].size < size) {
+    if (size < 2 * scratch[slot].size) size = 2 * scratch[slot].size;
+    ImageFree(scratch[slot].buf);
+    scratch[slot].buf = HeapMalloc(size);  // outlives any region
+    scratch[slot].size = size;
+  }
+  return scratch[slot].buf;
+}
+
+/// Release the scratch buffers of the calling thread.
+/// (They are allocated again when needed.)
+void ImageReleaseScratch(void) {
+  for (int slot = 0; slot < NUM_SCRATCH; slot++) {
+    ImageFree(scratch[slot].buf);
+    scratch[slot].buf = NULL;
+    scratch[slot].size = 0;
+  }
+}
+
+/// Get a scratch buffer for a worst-case RLE row of an image of given width.
+static RLEElem* ScratchRLERow(uint32 image_width) {
+  return Scratch(SCRATCH_RLE, ((size_t)image_width + 2) * sizeof(RLEElem));
+}
 
-  // How many runs?
-  uint32 num_runs = GetNumRunsInRAWRow(image_width, RAW_row);
+/// Does the row array live in the file mapping of img (not in the heap)?
+static int IsMappedRow(const Image img, const RLEElem* row) {
+  return img->map != NULL && (const char*)row >= (const char*)img->map &&
+         (const char*)row < (const char*)img->map + img->map_size;
+}
 
-  // Allocate the RLE row array
-  int* RLE_row = malloc((num_runs + 2) * sizeof(int));
-  check(RLE_row != NULL, "malloc");
+/// Append a run of length pixels of color value to a RLE row under
+/// construction, whose last run is at index *last (0 if there is none yet).
+/// Empty runs are ignored, and a run of the same color as the last one
+/// extends it.  To finish the row: RLE_row[++*last] = EOR.
+static void PushRun(RLEElem* RLE_row, uint32* last, int value, uint32 length) {
+  if (length == 0) return;
+  if (*last == 0) {
+    RLE_row[0] = value;
+    RLE_row[*last = 1] = length;
+  } else if (value == (int)((RLE_row[0] ^ (*last - 1)) & 1)) {
+    RLE_row[*last] += length;
+  } else {
+    RLE_row[++*last] = length;
+  }
+}
 
-  // Go through the RAW_row
-  RLE_row[0] = (int)RAW_row[0];  // Initial pixel value
-  uint32 index = 1;
-  int num_pixels = 1;
-  for (uint32 i = 1; i < image_width; i++) {
-    if (RAW_row[i] != RAW_row[i - 1]) {
-      RLE_row[index++] = num_pixels;
-      num_pixels = 0;
+/// Append to a RLE row under construction (see PushRun) the pixels of
+/// columns x to x+width-1 of RLE_row.
+static void PushRuns(RLEElem* out, uint32* last, const RLEElem* RLE_row, uint32 x,
+                     uint32 width) {
+  uint32 end = x + width;
+  uint32 pos = 0;  // first column of run j
+  int value = RLE_row[0];
+  uint32 j;
+  for (j = 1; RLE_row[j] != EOR && pos < end; j++) {
+    uint32 next = pos + RLE_row[j];
+    if (next > x) {
+      uint32 from = pos > x ? pos : x;
+      uint32 to = next < end ? next : end;
+      PushRun(out, last, value, to - from);
     }
-    num_pixels++;
+    pos = next;
+    value ^= 1;
   }
-  RLE_row[index++] = num_pixels;
-  RLE_row[index] = EOR;  // Reached the end of the row
+  COUNT_PIXMEM(j - 1);
+}
 
-  return RLE_row;
+/// Get the width of tile t of img.
+static uint32 TileWidth(const Image img, uint32 t) {
+  uint32 x = t * img->tile_width;
+  return (img->width - x < img->tile_width) ? img->width - x : img->tile_width;
 }
 
-static uint8* UncompressRow(uint32 image_width, const int* RLE_row) {
-  assert(image_width > 0);
-  assert(RLE_row != NULL);
+/// Get row i of img into buffer (with room for width + 2 elements), or
+/// return the stored row itself, if there is one (untiled images).
+static const RLEElem* GetRowInto(const Image img, uint32 i, RLEElem* buffer) {
+  assert(i < img->height);
+  if (img->gen != NULL) {
+    img->gen(img, i, buffer);
+    buffer[0] ^= img->invert;
+    return buffer;
+  }
+  if (img->num_tiles == 1) return img->row[i];
+  // Join the tiles (runs that cross a tile boundary are merged)
+  RLEElem** tiles = img->row + (size_t)i * img->num_tiles;
+  uint32 last = 0;
+  for (uint32 t = 0; t < img->num_tiles; t++) {
+    PushRuns(buffer, &last, tiles[t], 0, TileWidth(img, t));
+  }
+  buffer[++last] = EOR;
+  return buffer;
+}
 
-  // The uncompressed row
-  uint8* row = (uint8*)malloc(image_width * sizeof(uint8));
-  check(row != NULL, "malloc");
+/// Get row i of img, for reading.
+/// For stored untiled images, this is the row array itself.
+/// For procedural and tiled images, the row is built into scratch buffer
+/// number slot (SCRATCH_ROW1 or SCRATCH_ROW2), valid until the slot is
+/// used again.
+static const RLEElem* GetRow(const Image img, uint32 i, int slot) {
+  assert(i < img->height);
+  if (img->gen == NULL && img->num_tiles == 1) return img->row[i];
+  assert(slot == SCRATCH_ROW1 || slot == SCRATCH_ROW2);
+  RLEElem* row = Scratch(slot, ((size_t)img->width + 2) * sizeof(RLEElem));
+  return GetRowInto(img, i, row);
+}
 
-  // Go through the RLE_row until EOR is found
-  int pixel_value = RLE_row[0];
-  uint32 i = 1;
-  uint32 dest_i = 0;
-  while (RLE_row[i] != EOR) {
-    // For each run
-    for (int aux = 0; aux < RLE_row[i]; aux++) {
-      row[dest_i++] = (uint8)pixel_value;
-    }
-    // Next run
-    i++;
-    pixel_value ^= 1;
+/// Turn a procedural image into a stored one, with all rows allocated.
+/// (No effect on stored images.)
+static void Materialize(Image img) {
+  if (img->gen == NULL) return;
+  ImageRegion saved = current_region;
+  current_region = BlockRegion(img);  // rows live as long as img
+  img->row = ImageMalloc(img->height * sizeof(RLEElem*));
+  RLEElem* buffer = ScratchRLERow(img->width);
+  for (uint32 i = 0; i < img->height; i++) {
+    uint32 size = img->gen(img, i, buffer);
+    buffer[0] ^= img->invert;
+    img->row[i] = AllocateRLERowArray(size);
+    memcpy(img->row[i], buffer, size * sizeof(RLEElem));
+  }
+  img->gen = NULL;
+  img->invert = 0;
+  current_region = saved;
+}
+
+/// Store a copy of a RLE row with size elements as entry k of the row
+/// array of img (a row, or a tile of a tiled image).
+/// The current row array is reused if it is large enough,
+/// otherwise it is released and a new one is allocated,
+/// in the allocation context of img.
+static void StoreTile(Image img, size_t k, const RLEElem* RLE_row, uint32 size) {
+  RLEElem* row = img->row[k];
+  if (row == NULL || IsMappedRow(img, row) ||
+      ImageBlockSize(row) < size * sizeof(RLEElem)) {
+    if (row != NULL && !IsMappedRow(img, row)) ImageFree(row);
+    ImageRegion saved = current_region;
+    current_region = BlockRegion(img);  // rows live as long as img
+    row = img->row[k] = AllocateRLERowArray(size);
+    current_region = saved;
   }
+  memcpy(row, RLE_row, size * sizeof(RLEElem));
+}
 
-  return row;
+/// Store a copy of a RLE row with size elements as row i of img.
+/// For tiled images, the row is split into its tiles.
+static void StoreRow(Image img, uint32 i, const RLEElem* RLE_row, uint32 size) {
+  if (img->num_tiles == 1) {
+    StoreTile(img, i, RLE_row, size);
+    return;
+  }
+  RLEElem* tile =
+      Scratch(SCRATCH_TILE, ((size_t)img->tile_width + 2) * sizeof(RLEElem));
+  for (uint32 t = 0; t < img->num_tiles; t++) {
+    uint32 last = 0;
+    PushRuns(tile, &last, RLE_row, t * img->tile_width, TileWidth(img, t));
+    tile[++last] = EOR;
+    StoreTile(img, (size_t)i * img->num_tiles + t, tile, last + 1);
+  }
 }
 
 // Add your auxiliary functions here...
@@ -237,14 +559,14 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val) {
   Image newImage = AllocateImageHeader(width, height);
 
   // All image pixels have the same value
-  int pixel_value = (int)val;
+  RLEElem pixel_value = val;
 
   // Creating the image rows, each row has just 1 run of pixels
   // Each row is represented by an array of 3 elements [value,length,EOR]
   for (uint32 i = 0; i < height; i++) {
     newImage->row[i] = AllocateRLERowArray(3);
     newImage->row[i][0] = pixel_value;
-    newImage->row[i][1] = (int)width;
+    newImage->row[i][1] = width;
     newImage->row[i][2] = EOR;
   }
 
@@ -266,7 +588,6 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val) {
 /// (The caller is responsible for destroying the returned image!)
 Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
                             uint8 first_value) {
-  assert(width == height);
   assert(width > 0 && height > 0 && square_edge > 0);
   assert(width % square_edge == 0 && height % square_edge == 0);
   assert(first_value == WHITE || first_value == BLACK);
@@ -283,7 +604,7 @@ Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
     // Set index variable to 1 and increment it after using it in the array to set the
     // ammount of pixel value changes in the row 
     index = 1;
-    for ( int j = 0; j < width; j += square_edge) {
+    for (uint64 j = 0; j < width; j += square_edge) {
       chessboard->row[i][index++] = square_edge;
     }
     // Finish creating the row with the End Of Row marker
@@ -292,6 +613,194 @@ Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
   return chessboard;
 }
 
+/// Procedural images
+
+// Each generator writes row i of img into RLE_row (which has room for
+// width + 2 elements) and returns the number of elements written.
+
+// Constant image: param[0] = color
+static uint32 GenConstantRow(const struct image* img, uint32 i,
+                             RLEElem* RLE_row) {
+  (void)i;
+  RLE_row[0] = img->param[0];
+  RLE_row[1] = img->width;
+  RLE_row[2] = EOR;
+  return 3;
+}
+
+// Runs of edge pixels, alternating colors, the first one of color first.
+// The last run may be shorter.
+static uint32 PushAlternatingRuns(RLEElem* RLE_row, uint32 width, uint32 edge,
+                                  int first) {
+  uint32 last = 0;
+  for (uint64 x = 0; x < width; x += edge) {
+    uint32 length = (width - x < edge) ? (uint32)(width - x) : edge;
+    PushRun(RLE_row, &last, first ^ (int)((x / edge) & 1), length);
+  }
+  RLE_row[++last] = EOR;
+  return last + 1;
+}
+
+// Chessboard: param[0] = square edge, param[1] = color of first pixel
+static uint32 GenChessboardRow(const struct image* img, uint32 i,
+                               RLEElem* RLE_row) {
+  uint32 edge = img->param[0];
+  int first = (int)img->param[1] ^ (int)((i / edge) & 1);
+  return PushAlternatingRuns(RLE_row, img->width, edge, first);
+}
+
+// Stripes: param[0] = stripe width, param[1] = color of first stripe,
+// param[2] = vertical (1) or horizontal (0) stripes
+static uint32 GenStripesRow(const struct image* img, uint32 i,
+                            RLEElem* RLE_row) {
+  uint32 edge = img->param[0];
+  int first = (int)img->param[1];
+  if (img->param[2]) {
+    return PushAlternatingRuns(RLE_row, img->width, edge, first);
+  }
+  RLE_row[0] = first ^ (int)((i / edge) & 1);
+  RLE_row[1] = img->width;
+  RLE_row[2] = EOR;
+  return 3;
+}
+
+// Grid: BLACK lines of param[1] pixels starting every param[0] pixels,
+// in both directions, on WHITE
+static uint32 GenGridRow(const struct image* img, uint32 i,
+                         RLEElem* RLE_row) {
+  uint32 spacing = img->param[0];
+  uint32 thickness = img->param[1];
+  uint32 last = 0;
+  if (i % spacing < thickness) {
+    PushRun(RLE_row, &last, BLACK, img->width);
+  } else {
+    for (uint64 x = 0; x < img->width; x += spacing) {
+      uint32 length =
+          (img->width - x < spacing) ? (uint32)(img->width - x) : spacing;
+      uint32 line = (length < thickness) ? length : thickness;
+      PushRun(RLE_row, &last, BLACK, line);
+      PushRun(RLE_row, &last, WHITE, length - line);
+    }
+  }
+  RLE_row[++last] = EOR;
+  return last + 1;
+}
+
+// Rectangle: BLACK rectangle with corner (param[0], param[1]) and size
+// param[2] x param[3], on WHITE (clipped to the image)
+static uint32 GenRectangleRow(const struct image* img, uint32 i,
+                              RLEElem* RLE_row) {
+  uint32 x = img->param[0];
+  uint32 y = img->param[1];
+  uint32 last = 0;
+  if (i >= y && i - y < img->param[3] && x < img->width) {
+    uint32 rw = img->param[2];
+    if (rw > img->width - x) rw = img->width - x;
+    PushRun(RLE_row, &last, WHITE, x);
+    PushRun(RLE_row, &last, BLACK, rw);
+    PushRun(RLE_row, &last, WHITE, img->width - x - rw);
+  }
+  if (last == 0) PushRun(RLE_row, &last, WHITE, img->width);
+  RLE_row[++last] = EOR;
+  return last + 1;
+}
+
+/// Create a procedural image with the given generator and parameters.
+static Image AllocateProceduralImage(uint32 width, uint32 height,
+    uint32 (*gen)(const struct image*, uint32, RLEElem*),
+    uint32 p0, uint32 p1, uint32 p2, uint32 p3) {
+  assert(width > 0 && height > 0);
+  assert(width < UINT32_MAX);  // runs must be smaller than EOR
+  Image img = ImageMalloc(sizeof(struct image));
+  img->width = width;
+  img->height = height;
+  img->tile_width = width;
+  img->num_tiles = 1;
+  img->row = NULL;
+  img->map = NULL;
+  img->map_size = 0;
+  img->gen = gen;
+  img->param[0] = p0;
+  img->param[1] = p1;
+  img->param[2] = p2;
+  img->param[3] = p3;
+  img->invert = 0;
+  return img;
+}
+
+/// Procedural versions of ImageCreate and ImageCreateChessboard
+/// (any width, height and edge are accepted), and other test patterns.
+/// These images store no rows: rows are generated when needed.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+Image ImageGenConstant(uint32 width, uint32 height, uint8 val) {
+  assert(val == WHITE || val == BLACK);
+  return AllocateProceduralImage(width, height, GenConstantRow, val, 0, 0, 0);
+}
+
+Image ImageGenChessboard(uint32 width, uint32 height, uint32 square_edge,
+                         uint8 first_value) {
+  assert(square_edge > 0);
+  assert(first_value == WHITE || first_value == BLACK);
+  return AllocateProceduralImage(width, height, GenChessboardRow,
+                                 square_edge, first_value, 0, 0);
+}
+
+Image ImageGenStripes(uint32 width, uint32 height, uint32 stripe_width,
+                      uint8 first_value, int vertical) {
+  assert(stripe_width > 0);
+  assert(first_value == WHITE || first_value == BLACK);
+  return AllocateProceduralImage(width, height, GenStripesRow,
+                                 stripe_width, first_value, vertical != 0, 0);
+}
+
+Image ImageGenGrid(uint32 width, uint32 height, uint32 spacing,
+                   uint32 thickness) {
+  assert(spacing > 0);
+  return AllocateProceduralImage(width, height, GenGridRow,
+                                 spacing, thickness, 0, 0);
+}
+
+Image ImageGenRectangle(uint32 width, uint32 height, uint32 x, uint32 y,
+                        uint32 rect_width, uint32 rect_height) {
+  return AllocateProceduralImage(width, height, GenRectangleRow,
+                                 x, y, rect_width, rect_height);
+}
+
+/// Is img a procedural image?
+int ImageIsProcedural(const Image img) {
+  assert(img != NULL);
+  return img->gen != NULL;
+}
+
+/// Tiled images
+
+/// Create a copy of img with rows split into tiles of tile_width pixels
+/// (tile_width == 0 or tile_width >= width gives an untiled copy).
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTile(const Image img, uint32 tile_width) {
+  assert(img != NULL);
+  if (tile_width == 0) tile_width = img->width;
+
+  Image newImage = AllocateTiledImageHeader(img->width, img->height,
+                                            tile_width);
+  for (uint32 i = 0; i < img->height; i++) {
+    const RLEElem* row = GetRow(img, i, SCRATCH_ROW1);
+    StoreRow(newImage, i, row, GetSizeRLERowArray(row));
+  }
+  return newImage;
+}
+
+/// Get the tile width of img (0 if img is not tiled).
+uint32 ImageTileWidth(const Image img) {
+  assert(img != NULL);
+  return img->num_tiles > 1 ? img->tile_width : 0;
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -302,31 +811,120 @@ void ImageDestroy(Image* imgp) {
 
   Image img = *imgp;
 
-  for (uint32 i = 0; i < img->height; i++) {
-    free(img->row[i]);
+  if (BlockRegion(img) != NULL) {
+    // Released, mapping included, when its region ends
+    *imgp = NULL;
+    return;
+  }
+
+  size_t num_rows = (size_t)img->height * img->num_tiles;
+  for (size_t k = 0; k < num_rows && img->row != NULL; k++) {
+    if (!IsMappedRow(img, img->row[k])) ImageFree(img->row[k]);
   }
-  free(img->row);
-  free(img);
+  if (img->map != NULL) {
+    // Most rows live in a file mapping
+    munmap(img->map, img->map_size);
+  }
+  ImageFree(img->row);
+  ImageFree(img);
 
   *imgp = NULL;
 }
 
+/// Allocation regions
+
+/// Make a copy of img, with the same tiles, in the current allocation
+/// context.  Mapped rows are copied too.
+static Image CopyImage(const Image img) {
+  if (img->gen != NULL) {
+    Image copy = ImageMalloc(sizeof(struct image));
+    *copy = *img;
+    return copy;
+  }
+  Image copy = AllocateTiledImageHeader(img->width, img->height,
+                                        img->tile_width);
+  size_t num_rows = (size_t)img->height * img->num_tiles;
+  for (size_t k = 0; k < num_rows; k++) {
+    uint32 size = GetSizeRLERowArray(img->row[k]);
+    copy->row[k] = AllocateRLERowArray(size);
+    memcpy(copy->row[k], img->row[k], size * sizeof(RLEElem));
+  }
+  return copy;
+}
+
+/// Begin a new region and make it the current allocation context of the
+/// calling thread.
+ImageRegion ImageRegionBegin(void) {
+  ImageRegion r = HeapMalloc(sizeof(struct imageRegion));
+  r->parent = current_region;
+  r->chunks = NULL;
+  r->free = r->end = NULL;
+  r->chunk_size = REGION_CHUNK_MIN;
+  r->maps = NULL;
+  current_region = r;
+  return r;
+}
+
+/// Make region (NULL: the heap) the current allocation context of the
+/// calling thread, and return the previous one.
+ImageRegion ImageRegionUse(ImageRegion region) {
+  ImageRegion previous = current_region;
+  current_region = region;
+  return previous;
+}
+
+/// Copy img out of region, into the context that was current when region
+/// began.  Images not allocated in region are returned unchanged.
+Image ImageRegionPromote(ImageRegion region, const Image img) {
+  assert(region != NULL && img != NULL);
+  if (BlockRegion(img) != region) return img;
+  ImageRegion saved = ImageRegionUse(region->parent);
+  Image copy = CopyImage(img);
+  ImageRegionUse(saved);
+  return copy;
+}
+
+/// End the current region: release all its memory at once and restore
+/// the context that was current when it began.
+void ImageRegionEnd(ImageRegion* regionp) {
+  assert(regionp != NULL);
+  ImageRegion r = *regionp;
+  assert(r != NULL && r == current_region);
+
+  for (RegionMap* m = r->maps; m != NULL; m = m->next) {
+    munmap(m->map, m->size);
+  }
+  RegionChunk* chunk = r->chunks;
+  while (chunk != NULL) {
+    RegionChunk* next = chunk->next;
+    CountFree(chunk->size);
+    free(chunk);
+    chunk = next;
+  }
+  current_region = r->parent;
+  ImageFree(r);
+
+  *regionp = NULL;
+}
+
 /// Printing on the console
 
 /// Output the raw BW image
 void ImageRAWPrint(const Image img) {
   assert(img != NULL);
 
-  printf("width = %d height = %d\n", img->width, img->height);
+  printf("width = %" PRIu32 " height = %" PRIu32 "\n", img->width,
+         img->height);
   printf("RAW image:\n");
 
   // Print the pixels of each image row
   for (uint32 i = 0; i < img->height; i++) {
+    const RLEElem* row = GetRow(img, i, SCRATCH_ROW1);
     // The value of the first pixel in the current row
-    int pixel_value = img->row[i][0];
-    for (uint32 j = 1; img->row[i][j] != EOR; j++) {
+    int pixel_value = row[0];
+    for (uint32 j = 1; row[j] != EOR; j++) {
       // Print the current run of pixels
-      for (int k = 0; k < img->row[i][j]; k++) {
+      for (uint32 k = 0; k < row[j]; k++) {
         printf("%d", pixel_value);
       }
       // Switch (XOR) to the pixel value for the next run, if any
@@ -342,16 +940,18 @@ void ImageRAWPrint(const Image img) {
 void ImageRLEPrint(const Image img) {
   assert(img != NULL);
 
-  printf("width = %d height = %d\n", img->width, img->height);
+  printf("width = %" PRIu32 " height = %" PRIu32 "\n", img->width,
+         img->height);
   printf("RLE encoding:\n");
 
   // Print the compressed rows information
   for (uint32 i = 0; i < img->height; i++) {
+    const RLEElem* row = GetRow(img, i, SCRATCH_ROW1);
     uint32 j;
-    for (j = 0; img->row[i][j] != EOR; j++) {
-      printf("%d ", img->row[i][j]);
+    for (j = 0; row[j] != EOR; j++) {
+      printf("%" PRIu32 " ", row[j]);
     }
-    printf("%d\n", img->row[i][j]);
+    printf("-1\n");  // EOR
   }
   printf("\n");
 }
@@ -360,32 +960,139 @@ void ImageRLEPrint(const Image img) {
 
 // See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
 
-// Auxiliary function
-static void unpackBits(int nbytes, const uint8 bytes[], uint8 raw_row[]) {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8) {  // or (mask > 0)
-    for (int b = 0; b < nbytes; b++) {
-      raw_row[8 * b + offset] = (bytes[b] & mask) != 0;
+// PBM rows are converted directly between packed bytes and RLE runs,
+// a chunk of bytes at a time: no RAW row is needed, and the buffers do
+// not grow with the image width.
+#define PBM_CHUNK 65536
+
+// A packed PBM row being compressed into a RLE row, some bytes at a time.
+typedef struct {
+  RLEElem* RLE_row;  // with room for width + 2 elements
+  uint32 width;
+  uint32 last;       // index of the last run stored (0: none yet)
+  uint32 x;          // pixels decoded
+  int value;         // color and length of the current run
+  uint32 length;
+} RowDecoder;
+
+// Compress the next n packed bytes of the row.
+static void DecodePacked(RowDecoder* d, const uint8* bytes, size_t n) {
+  for (size_t b = 0; b < n; b++) {
+    uint32 bits = d->width - d->x < 8 ? d->width - d->x : 8;
+    if (bits == 8 && bytes[b] == (d->value == BLACK ? 0xff : 0x00)) {
+      d->length += 8;  // the whole byte extends the current run
+    } else {
+      for (uint32 k = 0; k < bits; k++) {
+        int bit = (bytes[b] >> (7 - k)) & 1;
+        if (bit != d->value) {
+          PushRun(d->RLE_row, &d->last, d->value, d->length);
+          d->value = bit;
+          d->length = 0;
+        }
+        d->length++;
+      }
+    }
+    d->x += bits;
+  }
+  COUNT_PIXMEM(n);
+}
+
+// Decode the packed PBM row of width pixels in bytes into RLE_row
+// (with room for width + 2 elements), in place.
+// Returns the number of elements stored, including the EOR.
+static uint32 DecodePackedRow(const uint8* bytes, uint32 width,
+                              RLEElem* RLE_row) {
+  RowDecoder d = {RLE_row, width, 0, 0, WHITE, 0};
+  DecodePacked(&d, bytes, ((size_t)width + 7) / 8);
+  PushRun(RLE_row, &d.last, d.value, d.length);
+  RLE_row[++d.last] = EOR;
+  return d.last + 1;
+}
+
+// Read a packed PBM row of width pixels from f and compress it into
+// RLE_row (with room for width + 2 elements).
+// Returns the number of elements stored, including the EOR.
+static uint32 ReadPackedRow(FILE* f, uint32 width, RLEElem* RLE_row) {
+  uint8* chunk = Scratch(SCRATCH_BYTES, PBM_CHUNK);
+  uint64 nbytes = ((uint64)width + 7) / 8;
+  RowDecoder d = {RLE_row, width, 0, 0, WHITE, 0};
+  while (nbytes > 0) {
+    size_t n = nbytes < PBM_CHUNK ? (size_t)nbytes : PBM_CHUNK;
+    check(fread(chunk, sizeof(uint8), n, f) == n, "Reading pixels");
+    nbytes -= n;
+    DecodePacked(&d, chunk, n);
+  }
+  PushRun(RLE_row, &d.last, d.value, d.length);
+  RLE_row[++d.last] = EOR;
+  return d.last + 1;
+}
+
+// Destination of packed PBM bytes: a stream, a file descriptor written
+// with positioned writes (so that several threads may write to one file),
+// or memory.  Bytes are gathered in chunk and written when it is full.
+// In memory, chunk is the rest of the destination buffer itself, so the
+// bytes are never copied.
+typedef struct {
+  FILE* f;        // stream, or NULL to write to fd
+  int fd;         // file descriptor, or -1 to write to memory
+  uint64 offset;  // file offset of chunk[0] (fd only)
+  uint8* chunk;
+  size_t size;    // capacity of chunk
+  size_t n;       // bytes in chunk
+} PackedWriter;
+
+// Write the bytes gathered in w->chunk.
+static void FlushPacked(PackedWriter* w) {
+  if (w->f != NULL) {
+    check(fwrite(w->chunk, sizeof(uint8), w->n, w->f) == w->n,
+          "Writing pixels failed");
+  } else if (w->fd < 0) {
+    w->chunk += w->n;  // already in place
+    w->size -= w->n;
+  } else {
+    for (size_t done = 0; done < w->n;) {
+      ssize_t r = pwrite(w->fd, w->chunk + done, w->n - done,
+                         (off_t)(w->offset + done));
+      check(r > 0, "Writing pixels failed");
+      done += (size_t)r;
     }
-    mask >>= 1;
-    offset++;
   }
+  COUNT_PIXMEM(w->n);
+  w->offset += w->n;
+  w->n = 0;
 }
 
-// Auxiliary function
-static void packBits(int nbytes, uint8 bytes[], const uint8 raw_row[]) {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8) {  // or (mask > 0)
-    for (int b = 0; b < nbytes; b++) {
-      if (offset == 0) bytes[b] = 0;
-      bytes[b] |= raw_row[8 * b + offset] ? mask : 0;
+// Pack the pixels of RLE_row into PBM bytes, appending them to w.
+// Padding bits are WHITE.
+static void WritePackedRow(PackedWriter* w, const RLEElem* RLE_row) {
+  uint32 acc = 0;    // bits of the current byte
+  int nbits = 0;
+  int value = RLE_row[0];
+  for (uint32 j = 1; RLE_row[j] != EOR; j++, value ^= 1) {
+    uint32 length = RLE_row[j];
+    while (length > 0) {
+      if (nbits == 0 && length >= 8) {
+        // Whole bytes of the run color
+        size_t m = length / 8;
+        if (m > w->size - w->n) m = w->size - w->n;
+        memset(w->chunk + w->n, value == BLACK ? 0xff : 0x00, m);
+        w->n += m;
+        length -= (uint32)(8 * m);
+      } else {
+        acc = (acc << 1) | (uint32)value;
+        length--;
+        if (++nbits == 8) {
+          w->chunk[w->n++] = (uint8)acc;
+          acc = 0;
+          nbits = 0;
+        }
+      }
+      if (w->n == w->size) FlushPacked(w);
     }
-    mask >>= 1;
-    offset++;
+  }
+  if (nbits > 0) {
+    w->chunk[w->n++] = (uint8)(acc << (8 - nbits));
+    if (w->n == w->size) FlushPacked(w);
   }
 }
 
@@ -406,36 +1113,55 @@ static int skipComments(FILE* f) {
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 Image ImageLoad(const char* filename) {  ///
-  int w, h;
-  char c;
   FILE* f = NULL;
   Image img = NULL;
 
   check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  img = ImageLoadStream(f);
+  errno = 0;
+  check(img != NULL, "Invalid file format");
+
+  fclose(f);
+  return img;
+}
+
+/// Load the next image from a stream of binary PBM images.
+/// PBM streams may hold several images, one after the other;
+/// this reads exactly one of them, leaving the stream after its last byte.
+/// Returns NULL if the end of the stream is reached before any image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadStream(FILE* f) {  ///
+  assert(f != NULL);
+  uint32 w, h;
+  char c;
+  Image img = NULL;
+
+  // Skip whitespace between images and detect the end of the stream
+  int next;
+  while ((next = getc(f)) != EOF && isspace(next)) {}
+  if (next == EOF) return NULL;
+  ungetc(next, f);
+
   // Parse PBM header
   check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
   skipComments(f);
-  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
+  check(fscanf(f, "%" SCNu32 " ", &w) == 1 && w > 0 && w < UINT32_MAX,
+        "Invalid width");
   skipComments(f);
-  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
+  check(fscanf(f, "%" SCNu32, &h) == 1 && h > 0, "Invalid height");
   check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
 
   // Allocate image
   img = AllocateImageHeader(w, h);
 
-  // Read pixels
-  int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  uint8 raw_row[nbytes * 8];
+  // Read pixels, compressing each row as it is read
+  RLEElem* buffer = ScratchRLERow(w);
   for (uint32 i = 0; i < img->height; i++) {
-    check(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-          "Reading pixels");
-    unpackBits(nbytes, bytes, raw_row);
-    img->row[i] = CompressRow(w, raw_row);
+    uint32 size = ReadPackedRow(f, w, buffer);
+    StoreRow(img, i, buffer, size);
   }
 
-  fclose(f);
   return img;
 }
 
@@ -444,175 +1170,2397 @@ Image ImageLoad(const char* filename) {  ///
 /// On failure, does not return, EXITS program!
 int ImageSave(const Image img, const char* filename) {  ///
   assert(img != NULL);
-  int w = img->width;
-  int h = img->height;
   FILE* f = NULL;
 
   check((f = fopen(filename, "wb")) != NULL, "Open failed");
-  check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
-
-  // Write pixels
-  int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  // unit8 raw_row[nbytes*8];
-  for (uint32 i = 0; i < img->height; i++) {
-    // UncompressRow...
-    uint8* raw_row = UncompressRow(nbytes * 8, img->row[i]);
-    // Fill padding pixels with WHITE
-    memset(raw_row + w, WHITE, nbytes * 8 - w);
-    packBits(nbytes, bytes, raw_row);
-    size_t written = fwrite(bytes, sizeof(uint8), nbytes, f);
-    check(written == (size_t)nbytes, "Writing pixels failed");
-    free(raw_row);
-  }
+  ImageSaveStream(img, f);
 
   // Cleanup
-  fclose(f);
+  check(fclose(f) == 0, "Closing file failed");
   return 0;
 }
 
-/// Information queries
-
-/// Get image width
-int ImageWidth(const Image img) {
+/// Write image in PBM format to an open stream.
+/// The stream is not closed.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveStream(const Image img, FILE* f) {  ///
   assert(img != NULL);
-  return img->width;
-}
+  assert(f != NULL);
+  check(fprintf(f, "P4\n%" PRIu32 " %" PRIu32 "\n", img->width,
+                img->height) > 0,
+        "Writing header failed");
+
+  // Write pixels, packing each row straight from its runs
+  PackedWriter w = {f, -1, 0, Scratch(SCRATCH_BYTES, PBM_CHUNK), PBM_CHUNK,
+                    0};
+  for (uint32 i = 0; i < img->height; i++) {
+    WritePackedRow(&w, GetRow(img, i, SCRATCH_ROW1));
+  }
+  FlushPacked(&w);
 
-/// Get image height
-int ImageHeight(const Image img) {
-  assert(img != NULL);
-  return img->height;
+  return 0;
 }
 
-/// Image comparison
-
-int ImageIsEqual(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-  // First, check if either the image's heights are different or not, if so, return 1
-   if ((img1->height != img2->height) || (img1->width != img2->width)) {
-    return 1;
-  } else if (GetSizeRLERowArray(img1->row[0]) != GetSizeRLERowArray(img2->row[0])) {
-    return 1; // Secondly, check if the size of the arrays of the RLE enconded pictures are different, if so, return 1
-  } else {
-    for (int i = 0; i < img1->height; i++) {
-      for (int j = 0; j < GetSizeRLERowArray(img1->row[0]); j++) {
-        if (img1->row[i][j] != img2->row[i][j]) {
-          return 1; // Check if the contents of the RLE enconded rows are different or not
-                    // and return 1 if any pixel is different
-        }
-      }
+// Skip whitespace and comments in the size bytes at p, from *pos.
+static void skipSpaceMem(const uint8* p, size_t size, size_t* pos) {
+  while (*pos < size && (isspace(p[*pos]) || p[*pos] == '#')) {
+    if (p[*pos] == '#') {
+      while (*pos < size && p[*pos] != '\n') ++*pos;
+    } else {
+      ++*pos;
     }
   }
-  return 0;
 }
 
-int ImageIsDifferent(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-  return !ImageIsEqual(img1, img2);
+// Parse a positive decimal number below UINT32_MAX at p[*pos].
+// Returns 0 if there is none.
+static uint32 parseUintMem(const uint8* p, size_t size, size_t* pos) {
+  uint64 v = 0;
+  size_t start = *pos;
+  while (*pos < size && isdigit(p[*pos]) && v < UINT32_MAX) {
+    v = 10 * v + (p[*pos] - '0');
+    ++*pos;
+  }
+  return (*pos > start && v < UINT32_MAX) ? (uint32)v : 0;
 }
 
-/// Boolean Operations on image pixels
+// Parse the PBM header in the size bytes at p and check that the pixels
+// follow it.  On success, returns NULL and sets *wp, *hp and *posp (start
+// of the pixels).  Otherwise, returns the failure message.
+static const char* ParsePBMHeaderMem(const uint8* p, size_t size,
+                                     uint32* wp, uint32* hp, size_t* posp) {
+  if (size < 2 || p[0] != 'P' || p[1] != '4') return "Invalid file format";
+  size_t pos = 2;
+  skipSpaceMem(p, size, &pos);
+  uint32 w = parseUintMem(p, size, &pos);
+  if (w == 0) return "Invalid width";
+  skipSpaceMem(p, size, &pos);
+  uint32 h = parseUintMem(p, size, &pos);
+  if (h == 0) return "Invalid height";
+  if (pos >= size || !isspace(p[pos])) return "Whitespace expected";
+  pos++;
+  size_t row_bytes = ((size_t)w + 7) / 8;
+  if ((size - pos) / row_bytes < h) return "Reading pixels";
+  *wp = w;
+  *hp = h;
+  *posp = pos;
+  return NULL;
+}
 
-/// These functions apply boolean operations to images,
-/// returning a new image as a result.
-///
-/// Operand images are left untouched and must be of the same size.
-///
+/// Load a binary PBM image from the size bytes at data, as found in a
+/// PBM file.  The pixels are decoded straight from data, which is neither
+/// copied nor changed.  Bytes after the image are ignored.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
+/// Invalid or truncated data EXITS the program, like ImageLoad.
+Image ImageLoadFromMemory(const void* data, size_t size) {  ///
+  assert(data != NULL || size == 0);
+  const uint8* p = data;
+  uint32 w, h;
+  size_t pos;
+  errno = 0;
+  const char* failmsg = ParsePBMHeaderMem(p, size, &w, &h, &pos);
+  check(failmsg == NULL, failmsg);
+  size_t row_bytes = ((size_t)w + 7) / 8;
+
+  Image img = AllocateImageHeader(w, h);
+  RLEElem* buffer = ScratchRLERow(w);
+  for (uint32 i = 0; i < h; i++) {
+    uint32 n = DecodePackedRow(p + pos, w, buffer);
+    StoreRow(img, i, buffer, n);
+    pos += row_bytes;
+  }
+  return img;
+}
 
-Image ImageNEG(const Image img) {
-  assert(img != NULL);
+/// Check that the size bytes at data hold a valid binary PBM image, as
+/// ImageLoadFromMemory expects: it then decodes them without failing.
+/// Returns 1 if they do, 0 otherwise.  Never exits.
+int ImageCheckMemory(const void* data, size_t size) {  ///
+  assert(data != NULL || size == 0);
+  uint32 w, h;
+  size_t pos;
+  return ParsePBMHeaderMem(data, size, &w, &h, &pos) == NULL;
+}
 
-  uint32 width = img->width;
-  uint32 height = img->height;
+/// Encode image in PBM format into the capacity bytes at buffer.
+/// Returns the size of the encoding; buffer is only written if it is
+/// large enough (so ImageSaveToMemory(img, NULL, 0) gives the size).
+/// Pixels are packed straight into buffer, with no intermediate copy.
+size_t ImageSaveToMemory(const Image img, void* buffer, size_t capacity) {  ///
+  assert(img != NULL);
+  assert(buffer != NULL || capacity == 0);
+  char header[32];
+  int len = snprintf(header, sizeof(header), "P4\n%" PRIu32 " %" PRIu32 "\n",
+                     img->width, img->height);
+  size_t raster = (((size_t)img->width + 7) / 8) * img->height;
+  size_t size = (size_t)len + raster;
+  if (capacity < size) return size;
+
+  memcpy(buffer, header, (size_t)len);
+  PackedWriter w = {NULL, -1, 0, (uint8*)buffer + len, raster, 0};
+  for (uint32 i = 0; i < img->height; i++) {
+    WritePackedRow(&w, GetRow(img, i, SCRATCH_ROW1));
+  }
+  FlushPacked(&w);
+  return size;
+}
 
-  Image newImage = AllocateImageHeader(width, height);
+// A range of rows of a parallel PBM save, and the counters of the
+// thread that wrote it (always 0 with NINSTR).
+typedef struct {
+  Image img;
+  uint32 first, count;
+  int fd;
+  uint64 offset;  // file offset of row first
+  unsigned long pixmem, allocs;
+} SaveRange;
+
+// Pack and write a range of rows at its offset.
+static void* SaveRangeRows(void* arg) {
+  SaveRange* r = arg;
+#ifndef NINSTR
+  unsigned long pixmem = PIXMEM;
+  unsigned long allocs = ALLOCS;
+#endif
+  PackedWriter w = {NULL, r->fd, r->offset, Scratch(SCRATCH_BYTES, PBM_CHUNK),
+                    PBM_CHUNK, 0};
+  for (uint32 i = r->first; i < r->first + r->count; i++) {
+    WritePackedRow(&w, GetRow(r->img, i, SCRATCH_ROW1));
+  }
+  FlushPacked(&w);
+#ifndef NINSTR
+  r->pixmem = PIXMEM - pixmem;
+  r->allocs = ALLOCS - allocs;
+#endif
+  return NULL;
+}
 
-  // Directly copying the rows, one by one
-  // And changing the value of row[i][0]
+static void* SaveRangeThread(void* arg) {
+  SaveRangeRows(arg);
+  ImageReleaseScratch();
+  return NULL;
+}
 
-  for (uint32 i = 0; i < height; i++) {
-    uint32 num_elems = GetSizeRLERowArray(img->row[i]);
-    newImage->row[i] = AllocateRLERowArray(num_elems);
-    memcpy(newImage->row[i], img->row[i], num_elems * sizeof(int));
-    newImage->row[i][0] ^= 1;  // Just negate the value of the first pixel run
+/// Save image to PBM file, encoding ranges of rows in parallel.
+int ImageSaveParallel(const Image img, const char* filename,
+                      int num_threads) {  ///
+  assert(img != NULL);
+  if (num_threads <= 0) num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0) num_threads = 1;
+  if ((uint32)num_threads > img->height) num_threads = (int)img->height;
+
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  check(fd >= 0, "Open failed");
+
+  // Every row takes nbytes, so the offset of each row is known
+  char header[32];
+  int hlen = snprintf(header, sizeof(header), "P4\n%" PRIu32 " %" PRIu32 "\n",
+                      img->width, img->height);
+  uint64 nbytes = ((uint64)img->width + 7) / 8;
+  uint64 total = (uint64)hlen + nbytes * img->height;
+  // Preallocate the whole file (plain resize where that is not supported)
+  if (posix_fallocate(fd, 0, (off_t)total) != 0) {
+    check(ftruncate(fd, (off_t)total) == 0, "Resizing file failed");
+  }
+  check(pwrite(fd, header, (size_t)hlen, 0) == hlen, "Writing header failed");
+
+  // Split the rows into num_threads ranges; the calling thread takes the
+  // first one.
+  SaveRange* range = ImageMalloc(num_threads * sizeof(SaveRange));
+  pthread_t* thread = ImageMalloc(num_threads * sizeof(pthread_t));
+  uint32 first = 0;
+  for (int t = 0; t < num_threads; t++) {
+    uint32 count = img->height / (uint32)num_threads +
+                   ((uint32)t < img->height % (uint32)num_threads);
+    range[t] = (SaveRange){img, first, count, fd,
+                           (uint64)hlen + nbytes * first, 0, 0};
+    first += count;
+    if (t > 0) {
+      check(pthread_create(&thread[t], NULL, SaveRangeThread, &range[t]) == 0,
+            "Creating thread failed");
+    }
   }
+  SaveRangeRows(&range[0]);
+  for (int t = 1; t < num_threads; t++) {
+    pthread_join(thread[t], NULL);
+#ifndef NINSTR
+    // Account for the work of the other threads here
+    COUNT_PIXMEM(range[t].pixmem);
+    InstrAdd(1, range[t].allocs);  // ALLOCS
+#endif
+  }
+  ImageFree(thread);
+  ImageFree(range);
 
-  return newImage;
+  check(close(fd) == 0, "Closing file failed");
+  return 0;
 }
 
-Image ImageAND(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-  assert((img1->height == img2->height) && (img1->width == img2->width));
-  // Initialize the image and it's width and height attributes
-  uint32 width = img1->width;
-  uint32 height = img1->height;
-  Image newImage = AllocateImageHeader(width, height);
+/// Native RLE file operations
+
+// A RLE file stores the row arrays exactly as they are kept in memory,
+// so that they can be mapped and used without decoding or copying.
+//
+//   header   RLEFileHeader
+//   index    one RLEIndexEntry per row
+//   rows     each row array: [color, run, run, ..., EOR] as native ints
+//
+// Row offsets are absolute and multiples of sizeof(RLEElem).
+// The index has its own checksum, checked on every load,
+// and each row has a checksum, checked only by ImageCheckRLE.
+// Files use the byte order of the machine that wrote them.
+
+#define RLE_MAGIC "AEDRLE1\n"
+#define RLE_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[8];          // RLE_MAGIC
+  uint32 byte_order;      // RLE_BYTE_ORDER, as written
+  uint32 width;
+  uint32 height;
+  uint32 index_checksum;  // checksum of the index
+  uint64 file_size;
+} RLEFileHeader;
+
+typedef struct {
+  uint64 offset;    // file offset of the row array
+  uint32 num_runs;  // the row array has num_runs + 2 elements
+  uint32 checksum;  // checksum of the row array
+} RLEIndexEntry;
+
+// 32-bit FNV-1a hash of n bytes, continuing from hash h.
+// Start with h = 2166136261u.
+static uint32 fnv1a(uint32 h, const void* data, size_t n) {
+  const uint8* p = data;
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ p[i]) * 16777619u;
+  }
+  return h;
+}
+
+/// Save image to a native RLE file.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveRLE(const Image img, const char* filename) {  ///
+  assert(img != NULL);
+  uint32 h = img->height;
+
+  // Build the index
+  RLEIndexEntry* index = ImageMalloc(h * sizeof(RLEIndexEntry));
+  uint64 offset = sizeof(RLEFileHeader) + (uint64)h * sizeof(RLEIndexEntry);
+  for (uint32 i = 0; i < h; i++) {
+    const RLEElem* row = GetRow(img, i, SCRATCH_ROW1);
+    uint32 size = GetSizeRLERowArray(row);
+    index[i].offset = offset;
+    index[i].num_runs = size - 2;
+    index[i].checksum = fnv1a(2166136261u, row, size * sizeof(RLEElem));
+    offset += size * sizeof(RLEElem);
+  }
+
+  RLEFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RLE_MAGIC, sizeof(header.magic));
+  header.byte_order = RLE_BYTE_ORDER;
+  header.width = img->width;
+  header.height = h;
+  header.index_checksum = fnv1a(2166136261u, index, h * sizeof(RLEIndexEntry));
+  header.file_size = offset;
+
+  FILE* f = NULL;
+  check((f = fopen(filename, "wb")) != NULL, "Open failed");
+  check(fwrite(&header, sizeof(header), 1, f) == 1, "Writing header failed");
+  check(fwrite(index, sizeof(RLEIndexEntry), h, f) == h, "Writing index failed");
+  for (uint32 i = 0; i < h; i++) {
+    size_t size = index[i].num_runs + 2;
+    check(fwrite(GetRow(img, i, SCRATCH_ROW1), sizeof(RLEElem), size, f) == size,
+          "Writing rows failed");
+  }
+  check(fclose(f) == 0, "Closing file failed");
+
+  ImageFree(index);
+  return 0;
+}
+
+// Open a RLE file, read and validate its header and the index entries
+// of rows [first, first+*countp).  If *countp is 0, all rows are read.
+// Returns the file descriptor.
+// The index entries are returned in a block from ImageMalloc.
+static int OpenRLEFile(const char* filename, RLEFileHeader* header,
+                       uint32 first, uint32* countp, RLEIndexEntry** indexp) {
+  int fd = open(filename, O_RDONLY);
+  check(fd >= 0, "Open failed");
+  struct stat st;
+  check(fstat(fd, &st) == 0, "Stat failed");
+
+  check(pread(fd, header, sizeof(*header), 0) == (ssize_t)sizeof(*header) &&
+        memcmp(header->magic, RLE_MAGIC, sizeof(header->magic)) == 0 &&
+        header->byte_order == RLE_BYTE_ORDER,
+        "Invalid file format");
+  check(header->width > 0 && header->height > 0 &&
+        header->file_size == (uint64)st.st_size,
+        "Invalid or truncated file");
+  if (*countp == 0) *countp = header->height - first;
+  uint32 count = *countp;
+  check(first < header->height &&
+        count <= header->height - first,
+        "Invalid row range");
+
+  // Read only the part of the index that is needed.
+  // The whole index is checksummed only if the whole image is loaded.
+  size_t index_bytes = (size_t)count * sizeof(RLEIndexEntry);
+  RLEIndexEntry* index = ImageMalloc(index_bytes);
+  off_t index_pos = sizeof(RLEFileHeader) + (off_t)first * sizeof(RLEIndexEntry);
+  check(pread(fd, index, index_bytes, index_pos) == (ssize_t)index_bytes,
+        "Reading index failed");
+  if (count == header->height) {
+    check(fnv1a(2166136261u, index, index_bytes) == header->index_checksum,
+          "Index checksum mismatch");
+  }
+
+  uint64 data_start = sizeof(RLEFileHeader) +
+                      (uint64)header->height * sizeof(RLEIndexEntry);
+  for (uint32 i = 0; i < count; i++) {
+    uint64 size = ((uint64)index[i].num_runs + 2) * sizeof(RLEElem);
+    check(index[i].offset >= data_start &&
+          index[i].offset % sizeof(RLEElem) == 0 &&
+          index[i].num_runs >= 1 && index[i].num_runs <= header->width &&
+          size <= header->file_size - index[i].offset,
+          "Invalid index entry");
+  }
+
+  *indexp = index;
+  return fd;
+}
+
+// Map rows [first, first+count) of a RLE file (count 0 = up to the end)
+// into a new image.  Only the pages holding those rows are ever touched.
+// If check_rows, each row must start with a color and end with EOR
+// (the operations rely on both), or the program EXITS.
+static Image MapRLEFile(const char* filename, uint32 first, uint32 count,
+                        int check_rows) {
+  RLEFileHeader header;
+  RLEIndexEntry* index;
+  int fd = OpenRLEFile(filename, &header, first, &count, &index);
+
+  // Map the pages spanning the requested rows
+  uint64 page = (uint64)sysconf(_SC_PAGESIZE);
+  uint64 start = index[0].offset / page * page;
+  uint64 end = index[count - 1].offset +
+               ((uint64)index[count - 1].num_runs + 2) * sizeof(RLEElem);
+  size_t map_size = end - start;
+  // Private writable mapping: changes never reach the file.
+  void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                   (off_t)start);
+  check(map != MAP_FAILED, "mmap failed");
+  close(fd);
+
+  Image img = AllocateImageHeader(header.width, count);
+  img->map = map;
+  img->map_size = map_size;
+  ImageRegion region = BlockRegion(img);
+  if (region != NULL) {
+    // Unmapped with the region (ImageDestroy ignores region images)
+    RegionMap* m = RegionMalloc(region, sizeof(RegionMap));
+    m->map = map;
+    m->size = map_size;
+    m->next = region->maps;
+    region->maps = m;
+  }
+  for (uint32 i = 0; i < count; i++) {
+    RLEElem* row = (RLEElem*)((char*)map + (index[i].offset - start));
+    check(!check_rows || ((row[0] == WHITE || row[0] == BLACK) &&
+                          row[index[i].num_runs + 1] == EOR),
+          "Invalid row");
+    img->row[i] = row;
+  }
+
+  ImageFree(index);
+  return img;
+}
+
+/// Load rows [first, first+count) of a native RLE file,
+/// as an image of height count.
+/// The rows are mapped from the file, not read or copied.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadRLERows(const char* filename, uint32 first, uint32 count) {  ///
+  assert(count > 0);
+  return MapRLEFile(filename, first, count, 1);
+}
+
+/// Load a native RLE file.
+/// The rows are mapped from the file, not read or copied.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// Invalid files (header, index or rows) EXIT the program.
+Image ImageLoadRLE(const char* filename) {  ///
+  return MapRLEFile(filename, 0, 0, 1);
+}
+
+/// Check the integrity of a native RLE file:
+/// index checksum, row checksums, run counts and run lengths.
+/// Returns 1 if the file is valid, 0 otherwise.
+/// (Invalid headers and I/O errors still EXIT the program.)
+int ImageCheckRLE(const char* filename) {  ///
+  Image img = MapRLEFile(filename, 0, 0, 0);  // rows checked below
+  RLEFileHeader header;
+  RLEIndexEntry* index;
+  uint32 count = 0;
+  int fd = OpenRLEFile(filename, &header, 0, &count, &index);
+  close(fd);
+
+  int ok = 1;
+  for (uint32 i = 0; i < img->height && ok; i++) {
+    const RLEElem* row = img->row[i];
+    size_t size = index[i].num_runs + 2;
+    ok = fnv1a(2166136261u, row, size * sizeof(RLEElem)) == index[i].checksum &&
+         (row[0] == WHITE || row[0] == BLACK) && row[size - 1] == EOR;
+    uint64 total = 0;
+    for (size_t j = 1; j < size - 1 && ok; j++) {
+      ok = row[j] > 0;
+      total += (uint64)row[j];
+    }
+    ok = ok && total == img->width;
+  }
+
+  ImageFree(index);
+  ImageDestroy(&img);
+  return ok;
+}
+
+/// CCITT Group 4 (T.6) files
+
+// Group 4 codes each row relative to the previous one (the reference
+// row; the one above the first row is all WHITE), by the positions of
+// their changing elements: the columns where the color changes.
+// Those are exactly the run boundaries of the RLE rows, so rows are
+// coded and decoded without going through RAW pixels.
+// Each row starts WHITE, so changes alternate W->B (even indices of a
+// change list) and B->W (odd indices).
+// Bits are packed MSB first (TIFF FillOrder 1), and the data ends with
+// an EOFB (two EOL codes).
+
+typedef struct {
+  uint16 code;
+  uint8 len;
+} G4Code;
+
+// White runs: terminating codes (0 to 63)
+static const G4Code g4_white_term[64] = {
+    {0x35, 8}, {0x7, 6}, {0x7, 4}, {0x8, 4}, {0xb, 4}, {0xc, 4}, {0xe, 4},
+    {0xf, 4}, {0x13, 5}, {0x14, 5}, {0x7, 5}, {0x8, 5}, {0x8, 6}, {0x3, 6},
+    {0x34, 6}, {0x35, 6}, {0x2a, 6}, {0x2b, 6}, {0x27, 7}, {0xc, 7}, {0x8, 7},
+    {0x17, 7}, {0x3, 7}, {0x4, 7}, {0x28, 7}, {0x2b, 7}, {0x13, 7}, {0x24, 7},
+    {0x18, 7}, {0x2, 8}, {0x3, 8}, {0x1a, 8}, {0x1b, 8}, {0x12, 8}, {0x13, 8},
+    {0x14, 8}, {0x15, 8}, {0x16, 8}, {0x17, 8}, {0x28, 8}, {0x29, 8},
+    {0x2a, 8}, {0x2b, 8}, {0x2c, 8}, {0x2d, 8}, {0x4, 8}, {0x5, 8}, {0xa, 8},
+    {0xb, 8}, {0x52, 8}, {0x53, 8}, {0x54, 8}, {0x55, 8}, {0x24, 8},
+    {0x25, 8}, {0x58, 8}, {0x59, 8}, {0x5a, 8}, {0x5b, 8}, {0x4a, 8},
+    {0x4b, 8}, {0x32, 8}, {0x33, 8}, {0x34, 8},
+};
+
+// White runs: make-up codes (64 to 1728, step 64)
+static const G4Code g4_white_makeup[27] = {
+    {0x1b, 5}, {0x12, 5}, {0x17, 6}, {0x37, 7}, {0x36, 8}, {0x37, 8},
+    {0x64, 8}, {0x65, 8}, {0x68, 8}, {0x67, 8}, {0xcc, 9}, {0xcd, 9},
+    {0xd2, 9}, {0xd3, 9}, {0xd4, 9}, {0xd5, 9}, {0xd6, 9}, {0xd7, 9},
+    {0xd8, 9}, {0xd9, 9}, {0xda, 9}, {0xdb, 9}, {0x98, 9}, {0x99, 9},
+    {0x9a, 9}, {0x18, 6}, {0x9b, 9},
+};
+
+// Black runs: terminating codes (0 to 63)
+static const G4Code g4_black_term[64] = {
+    {0x37, 10}, {0x2, 3}, {0x3, 2}, {0x2, 2}, {0x3, 3}, {0x3, 4}, {0x2, 4},
+    {0x3, 5}, {0x5, 6}, {0x4, 6}, {0x4, 7}, {0x5, 7}, {0x7, 7}, {0x4, 8},
+    {0x7, 8}, {0x18, 9}, {0x17, 10}, {0x18, 10}, {0x8, 10}, {0x67, 11},
+    {0x68, 11}, {0x6c, 11}, {0x37, 11}, {0x28, 11}, {0x17, 11}, {0x18, 11},
+    {0xca, 12}, {0xcb, 12}, {0xcc, 12}, {0xcd, 12}, {0x68, 12}, {0x69, 12},
+    {0x6a, 12}, {0x6b, 12}, {0xd2, 12}, {0xd3, 12}, {0xd4, 12}, {0xd5, 12},
+    {0xd6, 12}, {0xd7, 12}, {0x6c, 12}, {0x6d, 12}, {0xda, 12}, {0xdb, 12},
+    {0x54, 12}, {0x55, 12}, {0x56, 12}, {0x57, 12}, {0x64, 12}, {0x65, 12},
+    {0x52, 12}, {0x53, 12}, {0x24, 12}, {0x37, 12}, {0x38, 12}, {0x27, 12},
+    {0x28, 12}, {0x58, 12}, {0x59, 12}, {0x2b, 12}, {0x2c, 12}, {0x5a, 12},
+    {0x66, 12}, {0x67, 12},
+};
+
+// Black runs: make-up codes (64 to 1728, step 64)
+static const G4Code g4_black_makeup[27] = {
+    {0xf, 10}, {0xc8, 12}, {0xc9, 12}, {0x5b, 12}, {0x33, 12}, {0x34, 12},
+    {0x35, 12}, {0x6c, 13}, {0x6d, 13}, {0x4a, 13}, {0x4b, 13}, {0x4c, 13},
+    {0x4d, 13}, {0x72, 13}, {0x73, 13}, {0x74, 13}, {0x75, 13}, {0x76, 13},
+    {0x77, 13}, {0x52, 13}, {0x53, 13}, {0x54, 13}, {0x55, 13}, {0x5a, 13},
+    {0x5b, 13}, {0x64, 13}, {0x65, 13},
+};
+
+// Extended make-up codes, both colors (1792 to 2560, step 64)
+static const G4Code g4_ext_makeup[13] = {
+    {0x8, 11}, {0xc, 11}, {0xd, 11}, {0x12, 12}, {0x13, 12}, {0x14, 12},
+    {0x15, 12}, {0x16, 12}, {0x17, 12}, {0x1c, 12}, {0x1d, 12}, {0x1e, 12},
+    {0x1f, 12},
+};
+
+static const G4Code g4_eol = {0x1, 12};
+
+// Mode codes
+static const G4Code g4_pass = {0x1, 4};
+static const G4Code g4_horizontal = {0x1, 3};
+static const G4Code g4_vertical[7] = {  // a1 - b1 = -3 .. 3
+    {0x2, 7}, {0x2, 6}, {0x2, 3}, {0x1, 1}, {0x3, 3}, {0x3, 6}, {0x3, 7},
+};
+
+// Bit writer: packs codes into a stream, MSB first
+typedef struct {
+  FILE* f;
+  uint32 bits;   // pending bits (the low nbits)
+  int nbits;
+  uint64 bytes;  // bytes written
+} G4Writer;
+
+static void PutCode(G4Writer* w, G4Code c) {
+  w->bits = (w->bits << c.len) | c.code;
+  w->nbits += c.len;
+  while (w->nbits >= 8) {
+    w->nbits -= 8;
+    check(putc((int)(w->bits >> w->nbits) & 0xff, w->f) != EOF,
+          "Writing G4 data failed");
+    w->bytes++;
+  }
+}
+
+// Write the codes of a run of length pixels of color value
+static void PutRun(G4Writer* w, int value, uint32 length) {
+  const G4Code* term = value == WHITE ? g4_white_term : g4_black_term;
+  const G4Code* makeup = value == WHITE ? g4_white_makeup : g4_black_makeup;
+  while (length >= 2560 + 64) {
+    PutCode(w, g4_ext_makeup[12]);
+    length -= 2560;
+  }
+  if (length >= 1792) {
+    PutCode(w, g4_ext_makeup[length / 64 - 28]);
+  } else if (length >= 64) {
+    PutCode(w, makeup[length / 64 - 1]);
+  }
+  PutCode(w, term[length % 64]);
+}
+
+// Get the changing elements of a RLE row into changes; returns how many.
+// The two elements after the last one are set to width (the imaginary
+// changes past the end of the row).
+static uint32 RowChanges(const RLEElem* RLE_row, uint32 width, uint32* changes) {
+  uint32 n = 0;
+  uint32 pos = 0;
+  if (RLE_row[0] == BLACK) changes[n++] = 0;
+  for (uint32 j = 1; RLE_row[j + 1] != EOR; j++) {
+    pos += RLE_row[j];
+    changes[n++] = pos;
+  }
+  changes[n] = changes[n + 1] = width;
+  return n;
+}
+
+// Find b1: the first change of the reference row after column a0 whose
+// color is opposite to color (W->B changes have even indices).
+// The search starts at *k - 1, since b1 never goes back further than
+// that while a row is coded; *k is updated.
+static uint32 FindB1(const uint32* ref, uint32 n, uint32* k, int64_t a0,
+                     int color) {
+  uint32 j = *k > 0 ? *k - 1 : 0;
+  while (j < n && ((int64_t)ref[j] <= a0 || (int)(j & 1) != color)) j++;
+  *k = j;
+  return j;
+}
+
+/// Write img as a raw Group 4 (T.6) bitstream to an open stream.
+/// Returns the number of bytes written.
+static uint64 WriteG4(const Image img, FILE* f) {
+  uint32 width = img->width;
+  size_t size = ((size_t)width + 3) * sizeof(uint32);
+  uint32* ref = ImageMalloc(size);
+  uint32* cur = ImageMalloc(size);
+  uint32 num_ref = 0;  // the row above the first one is WHITE
+  ref[0] = ref[1] = width;
+
+  G4Writer w = {f, 0, 0, 0};
+  for (uint32 i = 0; i < img->height; i++) {
+    uint32 num_cur = RowChanges(GetRow(img, i, SCRATCH_ROW1), width, cur);
+    int64_t a0 = -1;  // imaginary WHITE element before the row
+    int color = WHITE;
+    uint32 ia1 = 0;   // index of a1 in cur
+    uint32 kb1 = 0;   // index of b1 in ref
+    while (a0 < (int64_t)width) {
+      while (ia1 < num_cur && (int64_t)cur[ia1] <= a0) ia1++;
+      uint32 a1 = cur[ia1];
+      uint32 a2 = cur[ia1 + 1];
+      uint32 j = FindB1(ref, num_ref, &kb1, a0, color);
+      uint32 b1 = ref[j];
+      uint32 b2 = ref[j + 1];
+      if (b2 < a1) {  // pass mode
+        PutCode(&w, g4_pass);
+        a0 = b2;
+      } else if (a1 <= b1 + 3 && b1 <= a1 + 3) {  // vertical mode
+        PutCode(&w, g4_vertical[3 + (int)(a1 - b1)]);
+        a0 = a1;
+        color ^= 1;
+      } else {  // horizontal mode
+        PutCode(&w, g4_horizontal);
+        PutRun(&w, color, a1 - (a0 < 0 ? 0 : (uint32)a0));
+        PutRun(&w, color ^ 1, a2 - a1);
+        a0 = a2;
+      }
+    }
+    COUNT_PIXMEM(num_cur + num_ref);
+    uint32* tmp = ref;
+    ref = cur;
+    cur = tmp;
+    num_ref = num_cur;
+  }
+  PutCode(&w, g4_eol);  // EOFB
+  PutCode(&w, g4_eol);
+  if (w.nbits > 0) PutCode(&w, (G4Code){0, (uint8)(8 - w.nbits)});
+
+  ImageFree(ref);
+  ImageFree(cur);
+  return w.bytes;
+}
+
+// Bit reader over a G4 bitstream in memory
+typedef struct {
+  const uint8* data;
+  size_t size;
+  size_t pos;    // next byte to load
+  uint64 bits;   // loaded bits (the low nbits)
+  int nbits;
+} G4Reader;
+
+// Peek the next n bits (n <= 16); past the end of the data, bits are 0
+static uint32 PeekBits(G4Reader* r, int n) {
+  while (r->nbits < n) {
+    r->bits = (r->bits << 8) | (r->pos < r->size ? r->data[r->pos] : 0);
+    r->pos++;
+    r->nbits += 8;
+  }
+  return (uint32)(r->bits >> (r->nbits - n)) & ((1u << n) - 1);
+}
+
+static void SkipBits(G4Reader* r, int n) {
+  r->nbits -= n;
+  // Running far past the end of the data means it is corrupt
+  check(r->pos <= r->size + 2, "Invalid G4 data");
+}
+
+// Decoding tables of run codes, indexed by the next 13 bits
+#define G4_LOOKUP_BITS 13
+
+typedef struct {
+  uint16 run;  // run length (or make-up length)
+  uint8 len;   // code length (0 if there is no such code)
+} G4Entry;
+
+static void AddLookup(G4Entry* table, G4Code c, uint32 run) {
+  uint32 shift = G4_LOOKUP_BITS - c.len;
+  for (uint32 x = 0; x < (1u << shift); x++) {
+    table[(c.code << shift) | x] = (G4Entry){(uint16)run, c.len};
+  }
+}
+
+// Build the decoding table of color value, with 2^13 entries
+static void BuildLookup(G4Entry* table, int value) {
+  const G4Code* term = value == WHITE ? g4_white_term : g4_black_term;
+  const G4Code* makeup = value == WHITE ? g4_white_makeup : g4_black_makeup;
+  memset(table, 0, (1u << G4_LOOKUP_BITS) * sizeof(G4Entry));
+  for (uint32 j = 0; j < 64; j++) AddLookup(table, term[j], j);
+  for (uint32 j = 0; j < 27; j++) AddLookup(table, makeup[j], 64 * (j + 1));
+  for (uint32 j = 0; j < 13; j++) {
+    AddLookup(table, g4_ext_makeup[j], 1792 + 64 * j);
+  }
+}
+
+// Read the codes of a run (make-up codes, then a terminating code)
+static uint32 GetRun(G4Reader* r, const G4Entry* table) {
+  uint32 length = 0;
+  for (;;) {
+    G4Entry e = table[PeekBits(r, G4_LOOKUP_BITS)];
+    check(e.len > 0, "Invalid G4 data");
+    SkipBits(r, e.len);
+    length += e.run;
+    if (e.run < 64) return length;
+  }
+}
+
+// Modes, as read by GetMode
+enum { G4_PASS = 7, G4_HORIZONTAL = 8 };  // vertical: 0..6 = a1 - b1 + 3
+
+static int GetMode(G4Reader* r) {
+  uint32 bits = PeekBits(r, 7);
+  int mode;
+  int len;
+  if (bits >> 6 == 1) {
+    mode = 3; len = 1;                   // V0
+  } else if (bits >> 4 == 3) {
+    mode = 4; len = 3;                   // VR1
+  } else if (bits >> 4 == 2) {
+    mode = 2; len = 3;                   // VL1
+  } else if (bits >> 4 == 1) {
+    mode = G4_HORIZONTAL; len = 3;
+  } else if (bits >> 3 == 1) {
+    mode = G4_PASS; len = 4;
+  } else if (bits >> 1 == 3 || bits >> 1 == 2) {
+    mode = (bits >> 1 == 3) ? 5 : 1; len = 6;  // VR2, VL2
+  } else if (bits == 3 || bits == 2) {
+    mode = (bits == 3) ? 6 : 0; len = 7;       // VR3, VL3
+  } else {
+    mode = -1; len = 0;  // EOL, or an unsupported extension
+  }
+  check(mode >= 0, "Invalid G4 data (unexpected EOL or extension)");
+  SkipBits(r, len);
+  return mode;
+}
+
+/// Decode a raw Group 4 bitstream of a width x height image.
+/// (BLACK pixels are 1 in the data, as in PBM and TIFF WhiteIsZero.)
+static Image DecodeG4(const uint8* data, size_t size, uint32 width,
+                      uint32 height) {
+  check(width > 0 && height > 0, "Invalid G4 image size");
+  // Each row takes at least one bit
+  check(height <= 8 * (uint64)size, "Invalid G4 data (too short)");
+  G4Entry* tables = ImageMalloc(2 * (1u << G4_LOOKUP_BITS) * sizeof(G4Entry));
+  G4Entry* lookup[2] = {tables, tables + (1u << G4_LOOKUP_BITS)};
+  BuildLookup(lookup[WHITE], WHITE);
+  BuildLookup(lookup[BLACK], BLACK);
+
+  uint32* ref = ImageMalloc(((size_t)width + 3) * sizeof(uint32));
+  uint32 num_ref = 0;  // the row above the first one is WHITE
+  ref[0] = ref[1] = width;
+
+  Image img = AllocateImageHeader(width, height);
+  RLEElem* out = ScratchRLERow(width);
+  G4Reader r = {data, size, 0, 0, 0};
+  for (uint32 i = 0; i < height; i++) {
+    uint32 last = 0;  // the decoded runs go straight into out
+    int64_t a0 = -1;  // imaginary WHITE element before the row
+    int color = WHITE;
+    uint32 kb1 = 0;   // index of b1 in ref
+    while (a0 < (int64_t)width) {
+      int mode = GetMode(&r);
+      uint32 j = FindB1(ref, num_ref, &kb1, a0, color);
+      uint32 b1 = ref[j];
+      uint32 b2 = ref[j + 1];
+      uint32 start = a0 < 0 ? 0 : (uint32)a0;
+      if (mode == G4_PASS) {
+        PushRun(out, &last, color, b2 - start);
+        a0 = b2;
+      } else if (mode == G4_HORIZONTAL) {
+        uint32 run1 = GetRun(&r, lookup[color]);
+        uint32 run2 = GetRun(&r, lookup[color ^ 1]);
+        check((uint64)start + run1 + run2 <= width,
+              "Invalid G4 data (row too long)");
+        PushRun(out, &last, color, run1);
+        PushRun(out, &last, color ^ 1, run2);
+        a0 = (int64_t)start + run1 + run2;
+      } else {
+        int64_t a1 = (int64_t)b1 + mode - 3;
+        check(a1 >= (int64_t)start && a1 <= (int64_t)width,
+              "Invalid G4 data (bad vertical code)");
+        PushRun(out, &last, color, (uint32)a1 - start);
+        a0 = a1;
+        color ^= 1;
+      }
+    }
+    out[++last] = EOR;
+    StoreRow(img, i, out, last + 1);
+
+    // The decoded row is the reference for the next one
+    num_ref = RowChanges(out, width, ref);
+    COUNT_PIXMEM(2 * num_ref);
+  }
+
+  ImageFree(tables);
+  ImageFree(ref);
+  return img;
+}
+
+// Minimal TIFF container: little-endian header, the G4 strip, and one
+// IFD with the tags of a single-strip bilevel image.
+
+enum {
+  TIFF_WIDTH = 256, TIFF_LENGTH = 257, TIFF_BITS_PER_SAMPLE = 258,
+  TIFF_COMPRESSION = 259, TIFF_PHOTOMETRIC = 262, TIFF_FILL_ORDER = 266,
+  TIFF_STRIP_OFFSETS = 273, TIFF_SAMPLES_PER_PIXEL = 277,
+  TIFF_ROWS_PER_STRIP = 278, TIFF_STRIP_BYTE_COUNTS = 279,
+  TIFF_T6_OPTIONS = 293,
+};
+enum { TIFF_SHORT = 3, TIFF_LONG = 4 };
+#define TIFF_COMPRESSION_G4 4
+
+static void PutLE(FILE* f, uint32 value, int nbytes) {
+  for (int b = 0; b < nbytes; b++) {
+    check(putc((int)(value >> (8 * b)) & 0xff, f) != EOF,
+          "Writing TIFF failed");
+  }
+}
+
+static void PutTIFFEntry(FILE* f, uint16 tag, uint16 type, uint32 value) {
+  PutLE(f, tag, 2);
+  PutLE(f, type, 2);
+  PutLE(f, 1, 4);  // count
+  PutLE(f, value, type == TIFF_SHORT ? 2 : 4);
+  if (type == TIFF_SHORT) PutLE(f, 0, 2);  // padding of the value field
+}
+
+/// Save image to a TIFF file with Group 4 compression.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveG4(const Image img, const char* filename) {  ///
+  assert(img != NULL);
+  FILE* f = NULL;
+  check((f = fopen(filename, "wb")) != NULL, "Open failed");
+
+  // Header, with the IFD offset filled in after the strip is written
+  check(fwrite("II*\0\0\0\0\0", 1, 8, f) == 8, "Writing TIFF failed");
+  uint64 size = WriteG4(img, f);
+  check(size <= UINT32_MAX - 256, "Image too large for TIFF");
+  uint32 ifd = (uint32)(8 + size + (size & 1));  // word aligned
+  if (size & 1) PutLE(f, 0, 1);
+
+  PutLE(f, 11, 2);  // number of entries, in tag order
+  PutTIFFEntry(f, TIFF_WIDTH, TIFF_LONG, img->width);
+  PutTIFFEntry(f, TIFF_LENGTH, TIFF_LONG, img->height);
+  PutTIFFEntry(f, TIFF_BITS_PER_SAMPLE, TIFF_SHORT, 1);
+  PutTIFFEntry(f, TIFF_COMPRESSION, TIFF_SHORT, TIFF_COMPRESSION_G4);
+  PutTIFFEntry(f, TIFF_PHOTOMETRIC, TIFF_SHORT, 0);  // WhiteIsZero
+  PutTIFFEntry(f, TIFF_FILL_ORDER, TIFF_SHORT, 1);
+  PutTIFFEntry(f, TIFF_STRIP_OFFSETS, TIFF_LONG, 8);
+  PutTIFFEntry(f, TIFF_SAMPLES_PER_PIXEL, TIFF_SHORT, 1);
+  PutTIFFEntry(f, TIFF_ROWS_PER_STRIP, TIFF_LONG, img->height);
+  PutTIFFEntry(f, TIFF_STRIP_BYTE_COUNTS, TIFF_LONG, (uint32)size);
+  PutTIFFEntry(f, TIFF_T6_OPTIONS, TIFF_LONG, 0);
+  PutLE(f, 0, 4);  // no next IFD
+
+  check(fseek(f, 4, SEEK_SET) == 0, "Writing TIFF failed");
+  PutLE(f, ifd, 4);
+  check(fclose(f) == 0, "Closing file failed");
+  return 0;
+}
+
+/// Write image as a raw Group 4 (T.6) bitstream to an open stream
+/// (no header: the reader must know the width and height).
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveG4Stream(const Image img, FILE* f) {  ///
+  assert(img != NULL && f != NULL);
+  WriteG4(img, f);
+  return 0;
+}
+
+// Read an integer of nbytes at p, in the byte order of the TIFF file
+static uint32 GetTIFF(const uint8* p, int nbytes, int big_endian) {
+  uint32 value = 0;
+  for (int b = 0; b < nbytes; b++) {
+    int k = big_endian ? b : nbytes - 1 - b;
+    value = (value << 8) | p[k];
+  }
+  return value;
+}
+
+// Read a whole stream into a block from ImageMalloc; sets *sizep.
+static uint8* ReadAll(FILE* f, size_t* sizep) {
+  size_t size = 0;
+  size_t capacity = 1 << 16;
+  uint8* data = ImageMalloc(capacity);
+  size_t got;
+  while ((got = fread(data + size, 1, capacity - size, f)) > 0) {
+    size += got;
+    if (size == capacity) {
+      uint8* bigger = ImageMalloc(2 * capacity);
+      memcpy(bigger, data, size);
+      ImageFree(data);
+      data = bigger;
+      capacity *= 2;
+    }
+  }
+  check(!ferror(f), "Reading failed");
+  *sizep = size;
+  return data;
+}
+
+/// Load a TIFF file with Group 4 compression.
+/// Only single-strip bilevel images are accepted (as written by
+/// ImageSaveG4 and most fax and scanning software).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadG4(const char* filename) {  ///
+  FILE* f = NULL;
+  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  size_t size;
+  uint8* data = ReadAll(f, &size);
+  fclose(f);
+
+  errno = 0;
+  check(size >= 8 && (memcmp(data, "II*\0", 4) == 0 ||
+                      memcmp(data, "MM\0*", 4) == 0),
+        "Invalid TIFF file");
+  int big = data[0] == 'M';
+  uint32 ifd = GetTIFF(data + 4, 4, big);
+  check(ifd <= size - 2, "Invalid TIFF file");
+  uint32 num_entries = GetTIFF(data + ifd, 2, big);
+  check(num_entries <= (size - ifd - 2) / 12, "Invalid TIFF file");
+
+  uint32 width = 0, height = 0, rows_per_strip = UINT32_MAX;
+  uint32 bits = 1, compression = 1, photometric = 0, fill_order = 1;
+  uint32 samples = 1, offset = 0, byte_count = 0, num_strips = 0;
+  for (uint32 e = 0; e < num_entries; e++) {
+    const uint8* entry = data + ifd + 2 + 12 * e;
+    uint32 tag = GetTIFF(entry, 2, big);
+    uint32 type = GetTIFF(entry + 2, 2, big);
+    uint32 count = GetTIFF(entry + 4, 4, big);
+    if (type != TIFF_SHORT && type != TIFF_LONG) continue;
+    uint32 value = GetTIFF(entry + 8, type == TIFF_SHORT ? 2 : 4, big);
+    switch (tag) {
+      case TIFF_WIDTH: width = value; break;
+      case TIFF_LENGTH: height = value; break;
+      case TIFF_BITS_PER_SAMPLE: bits = value; break;
+      case TIFF_COMPRESSION: compression = value; break;
+      case TIFF_PHOTOMETRIC: photometric = value; break;
+      case TIFF_FILL_ORDER: fill_order = value; break;
+      case TIFF_SAMPLES_PER_PIXEL: samples = value; break;
+      case TIFF_ROWS_PER_STRIP: rows_per_strip = value; break;
+      case TIFF_STRIP_OFFSETS: offset = value; num_strips = count; break;
+      case TIFF_STRIP_BYTE_COUNTS: byte_count = value; break;
+    }
+  }
+  check(width > 0 && height > 0 && bits == 1 && samples == 1 &&
+            photometric <= 1,
+        "Invalid TIFF file (not a bilevel image)");
+  check(compression == TIFF_COMPRESSION_G4 && fill_order == 1,
+        "Unsupported TIFF file (not Group 4)");
+  check(num_strips == 1 && rows_per_strip >= height,
+        "Unsupported TIFF file (more than one strip)");
+  check(offset <= size && byte_count <= size - offset,
+        "Invalid TIFF file (truncated strip)");
+
+  Image img = DecodeG4(data + offset, byte_count, width, height);
+  if (photometric == 1) ImageNEGInPlace(img);  // BlackIsZero
+  ImageFree(data);
+  return img;
+}
+
+/// Load an image from a raw Group 4 (T.6) bitstream, read from an open
+/// stream up to its end.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadG4Stream(FILE* f, uint32 width, uint32 height) {  ///
+  assert(f != NULL);
+  size_t size;
+  uint8* data = ReadAll(f, &size);
+  errno = 0;
+  Image img = DecodeG4(data, size, width, height);
+  ImageFree(data);
+  return img;
+}
+
+/// Bitmap buffers
+
+// Import finds each run end a 64-bit word at a time: 1-bit rows are
+// loaded into a word with the next pixel at one end, and the run
+// continues up to the first bit that differs from its color (counted with
+// clz or ctz); 8-bit rows test 8 pixels per word.  Export writes the whole
+// bytes of each run with memset, and only sets bits at run ends.
+
+/// Load the up to 8 bytes at p (n of them) into a word, so that bit k of
+/// byte 0 is pixel k.  For IMAGE_BITMAP_MSB, pixel k of the word is bit
+/// 63 - k; for IMAGE_BITMAP_LSB, it is bit k.  Missing bytes read 0.
+static uint64 LoadBitmapWord(const uint8* p, size_t n, int format) {
+  uint64 word = 0;
+  if (format == IMAGE_BITMAP_MSB) {
+    for (size_t b = 0; b < 8; b++) {
+      word = (word << 8) | (b < n ? p[b] : 0);
+    }
+  } else {
+    for (size_t b = n < 8 ? n : 8; b-- > 0;) word = (word << 8) | p[b];
+  }
+  return word;
+}
+
+/// Count the pixels of color value from column x on (at most max) in the
+/// 1-bit row p of row_bytes bytes.  *loads counts the words loaded.
+static uint32 SameBits(const uint8* p, size_t row_bytes, uint32 x,
+                       uint32 max, int value, int format, uint32* loads) {
+  uint64 flip = value ? ~(uint64)0 : 0;  // makes the run color 0
+  uint32 count = 0;
+  while (count < max) {
+    uint32 pos = x + count;
+    size_t byte = pos / 8;
+    uint32 shift = pos % 8;
+    size_t n = row_bytes - byte < 8 ? row_bytes - byte : 8;
+    uint64 word = LoadBitmapWord(p + byte, n, format) ^ flip;
+    ++*loads;
+    uint32 avail = 8 * (uint32)n - shift;  // pixels of the word from pos
+    uint32 same;
+    if (format == IMAGE_BITMAP_MSB) {
+      word <<= shift;
+      same = word == 0 ? 64 : (uint32)__builtin_clzll(word);
+    } else {
+      word >>= shift;
+      same = word == 0 ? 64 : (uint32)__builtin_ctzll(word);
+    }
+    if (same < avail) return count + same < max ? count + same : max;
+    count += avail;
+  }
+  return max;
+}
+
+/// Count the pixels of color value from column x on (at most max) in the
+/// 8-bit row p (0 is WHITE, anything else BLACK).
+/// *loads counts the words and bytes read.
+static uint32 SameBytes(const uint8* p, uint32 x, uint32 max, int value,
+                        uint32* loads) {
+  const uint64 ones = 0x0101010101010101u;
+  uint32 count = 0;
+  while (max - count >= 8) {
+    uint64 word;
+    memcpy(&word, p + x + count, 8);
+    ++*loads;
+    // WHITE: all bytes 0.  BLACK: no byte 0.
+    int same = value ? ((word - ones) & ~word & (ones << 7)) == 0
+                     : word == 0;
+    if (!same) break;
+    count += 8;
+  }
+  while (count < max && (p[x + count] != 0) == value) {
+    ++*loads;
+    count++;
+  }
+  return count;
+}
+
+/// Create an image from the width x height pixels of a bitmap at data,
+/// with rows stride bytes apart.  format is IMAGE_BITMAP_MSB or
+/// IMAGE_BITMAP_LSB (1 bit per pixel, 1 is BLACK) or IMAGE_BITMAP_BYTES
+/// (1 byte per pixel, 0 is WHITE, anything else BLACK).
+/// Requires: stride at least the bytes of a row.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageFromBitmap(const void* data, uint32 width, uint32 height,
+                      size_t stride, int format) {
+  assert(data != NULL);
+  assert(width > 0 && height > 0);
+  assert(format == IMAGE_BITMAP_MSB || format == IMAGE_BITMAP_LSB ||
+         format == IMAGE_BITMAP_BYTES);
+  size_t row_bytes =
+      format == IMAGE_BITMAP_BYTES ? width : ((size_t)width + 7) / 8;
+  assert(stride >= row_bytes);
+
+  Image img = AllocateImageHeader(width, height);
+  RLEElem* buffer = ScratchRLERow(width);
+  uint32 loads = 0;
   for (uint32 i = 0; i < height; i++) {
-    // Uncompress the rows of the two images and allocate memory for the row
-    // where the results of the AND operation are going to be stored
-    uint8* uncompressedRow_1 = UncompressRow(img1->width, img1->row[i]);
-    uint8* uncompressedRow_2 = UncompressRow(img2->width, img2->row[i]);
-    uint8* new_uncompressedRow = (uint8*)malloc(sizeof(uint8)*img1->width);
-    for (int j = 0; j < img1->width; j++) {
-      // Fill the new uncompressed row with the RAW data equal to 
-      // applying the AND operation to the two other uncompressed rows
-      new_uncompressedRow[j] = uncompressedRow_1[j]*uncompressedRow_2[j];
-    }
-    // Compress the RAW row and then store it in newImage, then free all the uncompressed rows
-    newImage->row[i] = CompressRow(newImage->width, new_uncompressedRow);
-    free(uncompressedRow_1);
-    free(uncompressedRow_2);
-    free(new_uncompressedRow);
+    const uint8* p = (const uint8*)data + i * stride;
+    uint32 last = 0;
+    int value = WHITE;
+    for (uint32 x = 0; x < width;) {
+      uint32 length =
+          format == IMAGE_BITMAP_BYTES
+              ? SameBytes(p, x, width - x, value, &loads)
+              : SameBits(p, row_bytes, x, width - x, value, format, &loads);
+      PushRun(buffer, &last, value, length);
+      x += length;
+      value ^= 1;
+    }
+    buffer[++last] = EOR;
+    StoreRow(img, i, buffer, last + 1);
+  }
+  COUNT_PIXMEM(loads);
+  return img;
+}
+
+/// Set the pixels [x, x+length) of the 1-bit row p to value: whole bytes
+/// with memset, the others one by one.  Each byte is cleared when its
+/// first pixel is written, so the row needs no clearing beforehand.
+static void FillBits(uint8* p, uint32 x, uint32 length, int value,
+                     int format) {
+  uint32 end = x + length;
+  while (x < end && (x % 8 != 0 || end - x < 8)) {
+    if (x % 8 == 0) p[x / 8] = 0;
+    if (value) {
+      p[x / 8] |= format == IMAGE_BITMAP_MSB ? 0x80u >> (x % 8)
+                                             : 1u << (x % 8);
+    }
+    x++;
+  }
+  if (x < end) {
+    uint32 bytes = (end - x) / 8;
+    memset(p + x / 8, value ? 0xff : 0x00, bytes);
+    x += 8 * bytes;
+    FillBits(p, x, end - x, value, format);  // the partial last byte
+  }
+}
+
+/// Write the pixels of img to the bitmap at data, with rows stride bytes
+/// apart, in format (see ImageFromBitmap; IMAGE_BITMAP_BYTES writes 1 for
+/// BLACK).  Padding bits of 1-bit rows are WHITE; bytes past the row
+/// (up to stride) are left untouched.
+/// Requires: stride at least the bytes of a row.
+void ImageToBitmap(const Image img, void* data, size_t stride, int format) {
+  assert(img != NULL && data != NULL);
+  assert(format == IMAGE_BITMAP_MSB || format == IMAGE_BITMAP_LSB ||
+         format == IMAGE_BITMAP_BYTES);
+  assert(stride >= (format == IMAGE_BITMAP_BYTES
+                        ? img->width : ((size_t)img->width + 7) / 8));
+
+  for (uint32 i = 0; i < img->height; i++) {
+    uint8* p = (uint8*)data + i * stride;
+    const RLEElem* row = GetRow(img, i, SCRATCH_ROW1);
+    int value = row[0];
+    uint32 x = 0;
+    uint32 j;
+    for (j = 1; row[j] != EOR; j++, value ^= 1) {
+      if (format == IMAGE_BITMAP_BYTES) {
+        memset(p + x, value, row[j]);
+      } else {
+        FillBits(p, x, row[j], value, format);
+      }
+      x += row[j];
+    }
+    COUNT_PIXMEM(j - 1);
+  }
+}
+
+/// Information queries
+
+/// Get image width
+uint32 ImageWidth(const Image img) {
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get image height
+uint32 ImageHeight(const Image img) {
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Get the number of bytes of memory used by the image
+/// (image structure, array of row pointers and all RLE row arrays)
+/// Rows mapped from a RLE file are not counted.
+size_t ImageMemoryUsage(const Image img) {
+  assert(img != NULL);
+  if (img->gen != NULL) return sizeof(struct image);  // no rows stored
+  size_t num_rows = (size_t)img->height * img->num_tiles;
+  size_t bytes = sizeof(struct image) + num_rows * sizeof(RLEElem*);
+  for (size_t k = 0; k < num_rows; k++) {
+    if (IsMappedRow(img, img->row[k])) continue;
+    bytes += GetSizeRLERowArray(img->row[k]) * sizeof(RLEElem);
+  }
+  return bytes;
+}
+
+/// Get the number of runs of the image: the sum of the runs of its rows
+/// (runs that cross tile boundaries count once).
+uint64 ImageNumRuns(const Image img) {
+  assert(img != NULL);
+  uint64 runs = 0;
+  for (uint32 i = 0; i < img->height; i++) {
+    runs += GetNumRunsInRLERow(GetRow(img, i, SCRATCH_ROW1));
+  }
+  COUNT_PIXMEM(runs + img->height);
+  return runs;
+}
+
+/// Pixel and region access
+
+// Stored images (tiled or not) are handled as arrays of tiles:
+// an untiled image has a single tile per row, as wide as the image.
+// Only the tiles that overlap the columns of interest are visited.
+
+/// Get the color of pixel (x, y) of img.
+/// Requires: x < width, y < height.
+int ImageGetPixel(const Image img, uint32 x, uint32 y) {
+  assert(img != NULL);
+  assert(x < img->width && y < img->height);
+  const RLEElem* row;
+  if (img->gen != NULL) {
+    row = GetRow(img, y, SCRATCH_ROW1);
+  } else {
+    uint32 t = x / img->tile_width;
+    row = img->row[(size_t)y * img->num_tiles + t];
+    x -= t * img->tile_width;
+  }
+  // Find the run holding column x
+  int value = row[0];
+  uint32 j = 1;
+  uint32 end = row[1];
+  while (end <= x) {
+    end += row[++j];
+    value ^= 1;
+  }
+  COUNT_PIXMEM(j);
+  return value;
+}
+
+/// Crop the rectangle of img with top-left corner (x, y) and size w x h.
+/// The new image has the tile width of img.
+/// Requires: w > 0, h > 0 and the rectangle inside img.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 w, uint32 h) {
+  assert(img != NULL);
+  assert(w > 0 && w <= img->width && h > 0 && h <= img->height);
+  assert(x <= img->width - w && y <= img->height - h);
+
+  Image newImage = AllocateTiledImageHeader(w, h, img->tile_width);
+  RLEElem* out = ScratchRLERow(w);
+  for (uint32 i = 0; i < h; i++) {
+    uint32 last = 0;
+    if (img->gen != NULL) {
+      PushRuns(out, &last, GetRow(img, y + i, SCRATCH_ROW1), x, w);
+    } else {
+      RLEElem** tiles = img->row + (size_t)(y + i) * img->num_tiles;
+      uint32 tw = img->tile_width;
+      for (uint32 t = x / tw; t < img->num_tiles && t * tw < x + w; t++) {
+        uint32 from = (x > t * tw) ? x - t * tw : 0;
+        uint32 to = (x + w - t * tw < TileWidth(img, t)) ? x + w - t * tw
+                                                         : TileWidth(img, t);
+        PushRuns(out, &last, tiles[t], from, to - from);
+      }
+    }
+    out[++last] = EOR;
+    StoreRow(newImage, i, out, last + 1);
   }
   return newImage;
 }
 
-Image ImageOR(const Image img1, const Image img2) {
+/// Paint the rectangle of img with top-left corner (x, y) and size w x h
+/// with color val, in place.
+/// In tiled images, only the tiles that overlap the rectangle are rewritten.
+/// Requires: the rectangle inside img, val is either BLACK or WHITE.
+void ImageFillRect(Image img, uint32 x, uint32 y, uint32 w, uint32 h,
+                   uint8 val) {
+  assert(img != NULL);
+  assert(x <= img->width && w <= img->width - x);
+  assert(y <= img->height && h <= img->height - y);
+  assert(val == WHITE || val == BLACK);
+  if (w == 0) return;
+  Materialize(img);
+
+  uint32 tw = img->tile_width;
+  RLEElem* out = ScratchRLERow(tw);
+  for (uint32 i = y; i < y + h; i++) {
+    for (uint32 t = x / tw; t < img->num_tiles && t * tw < x + w; t++) {
+      size_t k = (size_t)i * img->num_tiles + t;
+      uint32 width = TileWidth(img, t);
+      uint32 from = (x > t * tw) ? x - t * tw : 0;
+      uint32 to = (x + w - t * tw < width) ? x + w - t * tw : width;
+      uint32 last = 0;
+      PushRuns(out, &last, img->row[k], 0, from);
+      PushRun(out, &last, val, to - from);
+      PushRuns(out, &last, img->row[k], to, width - to);
+      out[++last] = EOR;
+      StoreTile(img, k, out, last + 1);
+    }
+  }
+}
+
+/// Seed fill
+
+// Runs are maximal, so a 4-connected region of one color is made of whole
+// runs, and runs of adjacent rows touch when their column intervals
+// overlap.  The fills work on an index of all the runs of the image and
+// visit a region run by run, with an explicit stack of runs: no pixel is
+// handled individually.
+
+#define RUN_MARKED 2  // flag of runs reached by the fill
+
+typedef struct {
+  uint32 row;
+  size_t run;
+} RunRef;
+
+typedef struct {
+  uint32 width, height;
+  size_t* first;  // runs of row i are first[i] .. first[i+1]-1
+  uint32* start;  // first column of each run
+  uint8* flags;   // color (bit 0) and RUN_MARKED of each run
+  RunRef* stack;  // runs to visit (each run is pushed at most once),
+  size_t top;     // or NULL when the index is not used for a fill
+} RunMap;
+
+/// Build the run index of img (with a stack for fills, if stack is set).
+static void BuildRunMap(RunMap* m, const Image img, int stack) {
+  m->width = img->width;
+  m->height = img->height;
+  m->first = ImageMalloc(((size_t)img->height + 1) * sizeof(size_t));
+  m->first[0] = 0;
+  for (uint32 i = 0; i < img->height; i++) {
+    const RLEElem* row = GetRow(img, i, SCRATCH_ROW1);
+    uint32 j = 1;
+    while (row[j] != EOR) j++;
+    COUNT_PIXMEM(j);
+    m->first[i + 1] = m->first[i] + (j - 1);
+  }
+  size_t num_runs = m->first[img->height];
+  m->start = ImageMalloc(num_runs * sizeof(uint32));
+  m->flags = ImageMalloc(num_runs * sizeof(uint8));
+  m->stack = stack ? ImageMalloc(num_runs * sizeof(RunRef)) : NULL;
+  m->top = 0;
+  for (uint32 i = 0; i < img->height; i++) {
+    const RLEElem* row = GetRow(img, i, SCRATCH_ROW1);
+    uint32 x = 0;
+    size_t k = m->first[i];
+    for (uint32 j = 1; row[j] != EOR; j++, k++) {
+      m->start[k] = x;
+      m->flags[k] = (uint8)((row[0] ^ (j - 1)) & 1);
+      x += row[j];
+    }
+    COUNT_PIXMEM(k - m->first[i]);
+  }
+}
+
+static void DestroyRunMap(RunMap* m) {
+  ImageFree(m->stack);
+  ImageFree(m->flags);
+  ImageFree(m->start);
+  ImageFree(m->first);
+}
+
+/// Get the index of the run of row i holding column x.
+static size_t FindRun(const RunMap* m, uint32 i, uint32 x) {
+  size_t lo = m->first[i];
+  size_t hi = m->first[i + 1] - 1;
+  uint32 probes = 0;
+  while (lo < hi) {  // last run with start <= x
+    size_t mid = lo + (hi - lo + 1) / 2;
+    probes++;
+    if (m->start[mid] <= x) lo = mid;
+    else hi = mid - 1;
+  }
+  COUNT_PIXMEM(probes);
+  return lo;
+}
+
+/// Get the column just after run k of row i.
+static uint32 RunEnd(const RunMap* m, uint32 i, size_t k) {
+  return (k + 1 < m->first[i + 1]) ? m->start[k + 1] : m->width;
+}
+
+/// Mark run k of row i and push it, if it has color value and is unmarked.
+static void VisitRun(RunMap* m, uint32 i, size_t k, int value) {
+  if (m->flags[k] != value) return;
+  m->flags[k] |= RUN_MARKED;
+  m->stack[m->top++] = (RunRef){i, k};
+}
+
+/// Mark all runs of color value connected to the runs in the stack.
+static void FloodRuns(RunMap* m, int value) {
+  while (m->top > 0) {
+    RunRef r = m->stack[--m->top];
+    size_t k = r.run;
+    uint32 a = m->start[k];
+    uint32 b = RunEnd(m, r.row, k);
+    for (int d = -1; d <= 1; d += 2) {
+      if ((d < 0 && r.row == 0) || (d > 0 && r.row + 1 == m->height)) continue;
+      uint32 j = r.row + d;
+      // Visit the runs of row j overlapping columns [a, b)
+      size_t q0 = FindRun(m, j, a);
+      size_t q;
+      for (q = q0; q < m->first[j + 1] && m->start[q] < b; q++) {
+        VisitRun(m, j, q, value);
+      }
+      COUNT_PIXMEM(q - q0);
+    }
+  }
+}
+
+/// Rewrite the rows of img where some run has flags match, giving
+/// those runs color value.
+static void RecolorRuns(Image img, const RunMap* m, uint8 match, int value) {
+  RLEElem* out = ScratchRLERow(img->width);
+  for (uint32 i = 0; i < img->height; i++) {
+    size_t k = m->first[i];
+    while (k < m->first[i + 1] && m->flags[k] != match) k++;
+    COUNT_PIXMEM(k - m->first[i]);
+    if (k == m->first[i + 1]) continue;  // row unchanged
+    uint32 last = 0;
+    for (k = m->first[i]; k < m->first[i + 1]; k++) {
+      uint32 end = RunEnd(m, i, k);
+      int color = (m->flags[k] == match) ? value : (m->flags[k] & 1);
+      PushRun(out, &last, color, end - m->start[k]);
+    }
+    COUNT_PIXMEM(m->first[i + 1] - m->first[i]);
+    out[++last] = EOR;
+    StoreRow(img, i, out, last + 1);
+  }
+}
+
+/// Paint the 4-connected region of pixels of the color of pixel (x, y)
+/// that contains it with color val, in place.
+/// Requires: x < width, y < height, val is either BLACK or WHITE.
+void ImageFloodFill(Image img, uint32 x, uint32 y, uint8 val) {
+  assert(img != NULL);
+  assert(x < img->width && y < img->height);
+  assert(val == WHITE || val == BLACK);
+  int seed = ImageGetPixel(img, x, y);
+  if (seed == val) return;
+  Materialize(img);
+
+  RunMap m;
+  BuildRunMap(&m, img, 1);
+  VisitRun(&m, y, FindRun(&m, y, x), seed);
+  FloodRuns(&m, seed);
+  RecolorRuns(img, &m, (uint8)(seed | RUN_MARKED), val);
+  DestroyRunMap(&m);
+}
+
+/// Paint BLACK the holes of img, in place: the 4-connected WHITE regions
+/// that do not touch the border of the image.
+void ImageFillHoles(Image img) {
+  assert(img != NULL);
+  Materialize(img);
+
+  RunMap m;
+  BuildRunMap(&m, img, 1);
+  // The WHITE runs touching the border reach the background
+  for (uint32 i = 0; i < img->height; i++) {
+    size_t first = m.first[i];
+    size_t last = m.first[i + 1] - 1;
+    if (i == 0 || i + 1 == img->height) {
+      for (size_t k = first; k <= last; k++) VisitRun(&m, i, k, WHITE);
+    } else {
+      VisitRun(&m, i, first, WHITE);
+      VisitRun(&m, i, last, WHITE);
+    }
+  }
+  FloodRuns(&m, WHITE);
+  RecolorRuns(img, &m, WHITE, BLACK);  // unmarked WHITE runs
+  DestroyRunMap(&m);
+}
+
+/// Image comparison
+
+int ImageIsEqual(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  // First, check if the image's sizes are different, if so, return 0
+  if ((img1->height != img2->height) || (img1->width != img2->width)) {
+    return 0;
+  }
+  for (uint32 i = 0; i < img1->height; i++) {
+    // Then compare the RLE encoded rows (RLE encoding is unique)
+    const RLEElem* row1 = GetRow(img1, i, SCRATCH_ROW1);
+    const RLEElem* row2 = GetRow(img2, i, SCRATCH_ROW2);
+    uint32 j = 0;
+    while (row1[j] == row2[j] && row1[j] != EOR) j++;
+    COUNT_PIXMEM(2 * (j + 1));
+    if (row1[j] != row2[j]) return 0;
+  }
+  return 1;
+}
+
+int ImageIsDifferent(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  return !ImageIsEqual(img1, img2);
+}
+
+// Merge two RLE rows of the same width with XOR.
+// If out != NULL, the resulting RLE row is stored there
+// (it must have room for the runs of both rows plus 2 elements).
+// Returns the number of differing pixels and, if there are any,
+// sets *first and *last to the first and last differing columns.
+static uint32 XorRows(const RLEElem* row1, const RLEElem* row2, RLEElem* out,
+                      uint32* first, uint32* last) {
+  uint32 count = 0;
+  uint32 pos = 0;           // start of the current segment
+  int val1 = row1[0];       // colors of the current runs
+  int val2 = row2[0];
+  uint32 i1 = 1, i2 = 1;    // current runs
+  uint32 end1 = row1[1];    // end columns of the current runs
+  uint32 end2 = row2[1];
+  uint32 out_i = 0;
+  COUNT_PIXMEM(4);
+
+  while (row1[i1] != EOR) {
+    uint32 end = end1 < end2 ? end1 : end2;
+    int diff = val1 ^ val2;
+    if (diff) {
+      if (count == 0) *first = pos;
+      *last = end - 1;
+      count += end - pos;
+    }
+    if (out != NULL) PushRun(out, &out_i, diff, end - pos);
+    pos = end;
+    // Advance whichever runs end here
+    if (end1 == end) {
+      val1 ^= 1;
+      if (row1[++i1] != EOR) end1 += row1[i1];
+    }
+    if (end2 == end) {
+      val2 ^= 1;
+      if (row2[++i2] != EOR) end2 += row2[i2];
+    }
+  }
+  COUNT_PIXMEM((i1 - 1) + (i2 - 1));  // runs consumed
+  if (out != NULL) out[++out_i] = EOR;
+
+  return count;
+}
+
+/// Compare two images of the same size, working on the RLE rows.
+/// Returns the number and percentage of differing pixels and their
+/// bounding box (only meaningful if count > 0).
+/// If row_counts is not NULL, it must have room for height elements
+/// and receives the number of differing pixels in each row.
+/// If diffp is not NULL, *diffp receives a new image with the differences
+/// (BLACK where the images differ, i.e. img1 XOR img2).
+/// (The caller is responsible for destroying that image!)
+ImageDiffResult ImageDiff(const Image img1, const Image img2,
+                          uint32* row_counts, Image* diffp) {
   assert(img1 != NULL && img2 != NULL);
   assert((img1->height == img2->height) && (img1->width == img2->width));
-  // Initialize the image and it's width and height attributes
   uint32 width = img1->width;
   uint32 height = img1->height;
-  int value;
-  Image newImage = AllocateImageHeader(width, height);
+
+  ImageDiffResult result;
+  memset(&result, 0, sizeof(result));
+  result.xmin = width;
+  result.ymin = height;
+
+  Image diff = NULL;
+  RLEElem* buffer = NULL;
+  if (diffp != NULL) {
+    diff = AllocateImageHeader(width, height);
+    buffer = ScratchRLERow(width);
+  }
+
   for (uint32 i = 0; i < height; i++) {
-    // Uncompress the rows of the two images and allocate memory for the row
-    // where the results of the OR operation are going to be stored
-    uint8* uncompressedRow_1 = UncompressRow(img1->width, img1->row[i]);
-    uint8* uncompressedRow_2 = UncompressRow(img2->width, img2->row[i]);
-    uint8* new_uncompressedRow = (uint8*)malloc(sizeof(uint8)*img1->width);
-    for (int j = 0; j < img1->width; j++) {
-      // Fill the new uncompressed row with the RAW data equal to 
-      // applying the OR operation to the two other uncompressed rows
-      value = uncompressedRow_1[j]+uncompressedRow_2[j];
-      if (value == 0) {
-        new_uncompressedRow[j] = 0;
-      } else {
-        new_uncompressedRow[j] = 1;
+    uint32 first, last;
+    uint32 count = XorRows(GetRow(img1, i, SCRATCH_ROW1),
+                           GetRow(img2, i, SCRATCH_ROW2), buffer, &first, &last);
+    if (row_counts != NULL) row_counts[i] = count;
+    if (count > 0) {
+      result.count += count;
+      if (first < result.xmin) result.xmin = first;
+      if (last > result.xmax) result.xmax = last;
+      if (i < result.ymin) result.ymin = i;
+      result.ymax = i;
+    }
+    if (diff != NULL) {
+      StoreRow(diff, i, buffer, GetSizeRLERowArray(buffer));
+    }
+  }
+
+  result.percent = 100.0 * (double)result.count / ((double)width * height);
+  if (result.count == 0) result.xmin = result.ymin = 0;
+  if (diffp != NULL) *diffp = diff;
+  return result;
+}
+
+/// Pattern search
+
+// ImageFind checks the needle at each offset in three stages, from
+// cheapest to dearest, on run indexes (RunMap) of both images:
+//  1. Row fingerprints: if max_mismatch < needle height, then at any match
+//     at least one of any max_mismatch+1 needle rows matches its haystack
+//     row exactly.  Exact matches of a row are found from the run lengths
+//     alone (the inner runs must be equal), so only the offsets where one
+//     of the max_mismatch+1 rows with most runs matches are candidates.
+//     Otherwise, the black count of the whole window must be within
+//     max_mismatch of that of the needle.  Along a row, it changes slope
+//     only at run boundaries, so the slope changes are kept as the window
+//     slides down (a few per run), and the counts rebuilt in the scan.
+//  2. Black-pixel counts: each row adds at least the difference of its
+//     black counts to the mismatch; these come from per-run prefix counts.
+//  3. Run-merge XOR counting, row by row, stopping once the mismatch
+//     exceeds the limit.
+
+/// Get black[k] = number of BLACK pixels of the row of run k before it.
+static uint32* BlackPrefix(const RunMap* m) {
+  uint32* black = ImageMalloc(m->first[m->height] * sizeof(uint32));
+  for (uint32 i = 0; i < m->height; i++) {
+    uint32 count = 0;
+    for (size_t k = m->first[i]; k < m->first[i + 1]; k++) {
+      black[k] = count;
+      if (m->flags[k] & 1) count += RunEnd(m, i, k) - m->start[k];
+    }
+    COUNT_PIXMEM(m->first[i + 1] - m->first[i]);
+  }
+  return black;
+}
+
+/// Number of BLACK pixels in columns [0, x) of row i.
+static uint32 BlackBefore(const RunMap* m, const uint32* black, uint32 i,
+                          uint32 x) {
+  size_t k = FindRun(m, i, x);
+  return black[k] + ((m->flags[k] & 1) ? x - m->start[k] : 0);
+}
+
+/// Number of pixels that differ between columns [x, x+w) of row i of h
+/// and row s of n (of width w), or some value above limit, if greater.
+static uint64 WindowDiff(const RunMap* h, uint32 i, uint32 x, const RunMap* n,
+                         uint32 s, uint64 limit) {
+  uint64 diff = 0;
+  size_t q = FindRun(h, i, x);
+  size_t t = n->first[s];
+  uint32 pos = 0;  // column, relative to x
+  uint32 segments = 0;
+  while (pos < n->width) {
+    uint32 hend = RunEnd(h, i, q) - x;
+    uint32 nend = RunEnd(n, s, t);
+    uint32 end = hend < nend ? hend : nend;
+    if ((h->flags[q] ^ n->flags[t]) & 1) {
+      diff += end - pos;
+      if (diff > limit) break;
+    }
+    segments++;
+    pos = end;
+    if (pos == hend) q++;
+    if (pos == nend) t++;
+  }
+  COUNT_PIXMEM(segments);
+  return diff;
+}
+
+/// Add sign times the number of BLACK pixels in columns [x, x+w) of row i
+/// to the window counts, for every x: to *base, the count at x = 0, and to
+/// delta, the changes of slope (delta[x] changes the step from x to x+1).
+/// The pixel entering at x+w and the one leaving at x change color only
+/// at run starts, so each run adds at most two slope changes.
+static void AddWindowBlack(const RunMap* m, const uint32* black, uint32 i,
+                           uint32 w, int sign, int64_t* base, int32_t* delta) {
+  uint32 last = m->width - w;  // last window column
+  *base += sign * (int64_t)BlackBefore(m, black, i, w);
+  int prev = 0;
+  for (size_t k = m->first[i]; k < m->first[i + 1]; k++) {
+    int jump = sign * ((m->flags[k] & 1) - prev);  // color change at start
+    prev = m->flags[k] & 1;
+    uint32 start = m->start[k];
+    delta[start > w ? start - w : 0] += jump;  // pixel entering
+    if (start <= last) delta[start] -= jump;   // pixel leaving
+  }
+  COUNT_PIXMEM(m->first[i + 1] - m->first[i]);
+}
+
+/// An interval of candidate columns [from, to].
+typedef struct {
+  uint32 from, to;
+} Candidates;
+
+static int cmpCandidates(const void* a, const void* b) {
+  uint32 x = ((const Candidates*)a)->from;
+  uint32 y = ((const Candidates*)b)->from;
+  return (x > y) - (x < y);
+}
+
+/// Append to c the columns where row s of n matches row i of h exactly,
+/// found from the run lengths.  Returns the new number of intervals.
+static size_t RowMatches(const RunMap* h, uint32 i, const RunMap* n, uint32 s,
+                         Candidates* c, size_t count) {
+  size_t nfirst = n->first[s];
+  size_t nruns = n->first[s + 1] - nfirst;
+  uint32 w = n->width;
+  if (nruns == 1) {  // uniform row: any window inside a long enough run
+    COUNT_PIXMEM(h->first[i + 1] - h->first[i]);
+    for (size_t q = h->first[i]; q < h->first[i + 1]; q++) {
+      uint32 end = RunEnd(h, i, q);
+      if ((h->flags[q] & 1) == (n->flags[nfirst] & 1) &&
+          end - h->start[q] >= w) {
+        c[count++] = (Candidates){h->start[q], end - w};
+      }
+    }
+    return count;
+  }
+  // Run q of h must start where the second run of n does, and be followed
+  // by runs of the same lengths as the inner runs of n.
+  uint32 first_len = n->start[nfirst + 1];
+  uint32 last_len = w - n->start[nfirst + nruns - 1];
+  size_t compared = 0;
+  for (size_t q = h->first[i] + 1; q + nruns - 2 < h->first[i + 1]; q++) {
+    compared++;
+    if ((h->flags[q] & 1) != (n->flags[nfirst + 1] & 1)) continue;
+    if (h->start[q] - h->start[q - 1] < first_len) continue;
+    size_t t = 1;
+    while (t + 1 < nruns &&
+           RunEnd(h, i, q + t - 1) - h->start[q + t - 1] ==
+               RunEnd(n, s, nfirst + t) - n->start[nfirst + t]) {
+      t++;
+    }
+    compared += t - 1;
+    if (t + 1 < nruns) continue;
+    size_t last = q + nruns - 2;
+    if (RunEnd(h, i, last) - h->start[last] < last_len) continue;
+    uint32 x = h->start[q] - first_len;
+    c[count++] = (Candidates){x, x};
+  }
+  COUNT_PIXMEM(compared);
+  return count;
+}
+
+/// Find the positions where needle matches haystack with at most
+/// max_mismatch differing pixels.
+uint64 ImageFind(const Image haystack, const Image needle,
+                 uint64 max_mismatch, ImageMatch* matches, uint64 capacity) {
+  assert(haystack != NULL && needle != NULL);
+  assert(matches != NULL || capacity == 0);
+  if (needle->width > haystack->width || needle->height > haystack->height) {
+    return 0;
+  }
+  RunMap h, n;
+  BuildRunMap(&h, haystack, 0);
+  BuildRunMap(&n, needle, 0);
+  uint32* hblack = BlackPrefix(&h);
+  uint32* nblack = BlackPrefix(&n);
+  uint32 w = n.width;
+  uint32 nh = n.height;
+
+  // Black count of each needle row
+  uint32* nrow_black = ImageMalloc(nh * sizeof(uint32));
+  for (uint32 s = 0; s < nh; s++) nrow_black[s] = BlackBefore(&n, nblack, s, w);
+
+  // Fingerprint rows: the max_mismatch+1 needle rows with most runs
+  uint32 num_keys = max_mismatch < nh ? (uint32)max_mismatch + 1 : 0;
+  uint32* keys = ImageMalloc((num_keys + 1) * sizeof(uint32));
+  for (uint32 s = 0; s < nh; s++) {
+    // Insertion into keys, kept sorted by decreasing number of runs
+    size_t runs = n.first[s + 1] - n.first[s];
+    uint32 j = s < num_keys ? s : num_keys;
+    while (j > 0 && n.first[keys[j - 1] + 1] - n.first[keys[j - 1]] < runs) {
+      if (j < num_keys) keys[j] = keys[j - 1];
+      j--;
+    }
+    if (j < num_keys) keys[j] = s;
+  }
+  size_t max_runs = 1;
+  for (uint32 i = 0; i < h.height; i++) {
+    if (h.first[i + 1] - h.first[i] > max_runs) {
+      max_runs = h.first[i + 1] - h.first[i];
+    }
+  }
+  Candidates* cand = ImageMalloc(
+      (num_keys > 0 ? (size_t)num_keys * max_runs : h.width - w + 1) *
+      sizeof(Candidates));
+  // Without fingerprints, black counts of the windows (see AddWindowBlack)
+  int32_t* delta = NULL;
+  int64_t base = 0;
+  int64_t ntotal = 0;
+  if (num_keys == 0) {
+    for (uint32 s = 0; s < nh; s++) ntotal += nrow_black[s];
+    delta = ImageMalloc(((size_t)h.width - w + 1) * sizeof(int32_t));
+    memset(delta, 0, ((size_t)h.width - w + 1) * sizeof(int32_t));
+    for (uint32 s = 0; s + 1 < nh; s++) {
+      AddWindowBlack(&h, hblack, s, w, 1, &base, delta);
+    }
+  }
+
+  uint64 found = 0;
+  for (uint32 y = 0; y + nh <= h.height; y++) {
+    // Stage 1: candidate columns
+    size_t count = 0;
+    if (num_keys == 0) {
+      if (y > 0) AddWindowBlack(&h, hblack, y - 1, w, -1, &base, delta);
+      AddWindowBlack(&h, hblack, y + nh - 1, w, 1, &base, delta);
+      int64_t b = base;
+      int64_t step = 0;
+      for (uint32 x = 0; x + w <= h.width; x++) {
+        if ((uint64)(b > ntotal ? b - ntotal : ntotal - b) <= max_mismatch) {
+          cand[count++] = (Candidates){x, x};
+        }
+        step += delta[x];
+        b += step;
+      }
+    } else {
+      for (uint32 j = 0; j < num_keys; j++) {
+        count = RowMatches(&h, y + keys[j], &n, keys[j], cand, count);
       }
+      qsort(cand, count, sizeof(Candidates), cmpCandidates);
+    }
+    uint32 next = 0;  // first column not yet tried
+    for (size_t c = 0; c < count; c++) {
+      uint32 from = cand[c].from > next ? cand[c].from : next;
+      for (uint32 x = from; x <= cand[c].to; x++) {
+        // Stage 2: black counts
+        uint64 bound = 0;
+        for (uint32 s = 0; s < nh && bound <= max_mismatch; s++) {
+          uint32 b = BlackBefore(&h, hblack, y + s, x + w) -
+                     BlackBefore(&h, hblack, y + s, x);
+          bound += b > nrow_black[s] ? b - nrow_black[s] : nrow_black[s] - b;
+        }
+        if (bound > max_mismatch) continue;
+        // Stage 3: exact count
+        uint64 diff = 0;
+        for (uint32 s = 0; s < nh && diff <= max_mismatch; s++) {
+          diff += WindowDiff(&h, y + s, x, &n, s, max_mismatch - diff);
+        }
+        if (diff > max_mismatch) continue;
+        if (found < capacity) matches[found] = (ImageMatch){x, y, diff};
+        found++;
+      }
+      if (cand[c].to + 1 > next) next = cand[c].to + 1;
+    }
+  }
+
+  ImageFree(delta);
+  ImageFree(cand);
+  ImageFree(keys);
+  ImageFree(nrow_black);
+  ImageFree(nblack);
+  ImageFree(hblack);
+  DestroyRunMap(&n);
+  DestroyRunMap(&h);
+  return found;
+}
+
+/// Signatures
+
+// A signature summarizes an image in a fixed size, in one pass over the
+// runs: each BLACK run is spread over the IMAGE_SIG_BINS column bins it
+// covers, whose sums make the column profile and, IMAGE_SIG_BINS /
+// IMAGE_SIG_GRID bins at a time, the grid cells of its band of rows.
+// Bin k holds the columns x with k <= x * IMAGE_SIG_BINS / width < k + 1,
+// and likewise for rows, so grid cells are unions of bins.
+//
+// Counts are exact (saturated at UINT32_MAX), which makes them bounds:
+// two images of the same size differ in at least |a - b| pixels in any
+// area where they have a and b BLACK pixels.  Saturation keeps this true.
+//
+// The MinHash part estimates the Jaccard similarity of the sets of run
+// features (band of rows, column and length class of each BLACK run),
+// with one-permutation hashing: each feature is hashed once, and the
+// hash chooses the slot and the value (slots with no value hold
+// UINT32_MAX).
+
+#define IMAGE_SIG_BANDS 64  // bands of rows and columns of run features
+
+// splitmix64 finalizer: a well-mixed 64-bit hash of x.
+static uint64 Mix64(uint64 x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9u;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebu;
+  return x ^ (x >> 31);
+}
+
+static uint32 Saturate32(uint64 n) {
+  return n > UINT32_MAX ? UINT32_MAX : (uint32)n;
+}
+
+/// Compute the signature of img.
+void ImageComputeSignature(const Image img, ImageSignature* sig) {  ///
+  assert(img != NULL && sig != NULL);
+  const uint32 B = IMAGE_SIG_BINS;
+  const uint32 G = IMAGE_SIG_GRID;
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  uint64 grid[IMAGE_SIG_GRID * IMAGE_SIG_GRID] = {0};
+  uint64 rows[IMAGE_SIG_BINS] = {0};
+  uint64 cols[IMAGE_SIG_BINS] = {0};
+  uint32 start[IMAGE_SIG_BINS + 1];  // first column of each bin
+  for (uint32 k = 0; k <= B; k++) {
+    start[k] = (uint32)(((uint64)k * width + B - 1) / B);
+  }
+
+  memset(sig, 0, sizeof(*sig));
+  sig->width = width;
+  sig->height = height;
+  for (uint32 k = 0; k < IMAGE_SIG_HASHES; k++) sig->minhash[k] = UINT32_MAX;
+
+  uint64 runs = 0;
+  for (uint32 i = 0; i < height; i++) {
+    const RLEElem* row = GetRow(img, i, SCRATCH_ROW1);
+    uint32 band = (uint32)((uint64)i * B / height);
+    uint64 yq = (uint64)i * IMAGE_SIG_BANDS / height;
+    uint64 bins[IMAGE_SIG_BINS] = {0};
+    uint32 x = 0;
+    int value = row[0];
+    uint32 j;
+    for (j = 1; row[j] != EOR; j++, value ^= 1) {
+      uint32 end = x + row[j];
+      if (value == BLACK) {
+        for (uint32 k = (uint32)((uint64)x * B / width);
+             k < B && start[k] < end; k++) {
+          uint32 from = x > start[k] ? x : start[k];
+          uint32 to = end < start[k + 1] ? end : start[k + 1];
+          bins[k] += to - from;
+        }
+        uint64 xq = (uint64)x * IMAGE_SIG_BANDS / width;
+        uint64 lq = 32 - (uint64)__builtin_clz(row[j]);  // length class
+        uint64 hash = Mix64((yq << 16) | (xq << 8) | lq);
+        uint32 slot = (uint32)(hash >> 59);  // top 5 bits: 32 slots
+        uint32 h = (uint32)hash >> 1;        // never UINT32_MAX
+        if (h < sig->minhash[slot]) sig->minhash[slot] = h;
+      }
+      x = end;
+    }
+    runs += j - 1;
+    uint64 row_black = 0;
+    for (uint32 k = 0; k < B; k++) {
+      cols[k] += bins[k];
+      grid[band / (B / G) * G + k / (B / G)] += bins[k];
+      row_black += bins[k];
+    }
+    rows[band] += row_black;
+    sig->black += row_black;
+  }
+  COUNT_PIXMEM(runs);
+
+  for (uint32 k = 0; k < G * G; k++) sig->grid[k] = Saturate32(grid[k]);
+  for (uint32 k = 0; k < B; k++) {
+    sig->rows[k] = Saturate32(rows[k]);
+    sig->cols[k] = Saturate32(cols[k]);
+  }
+}
+
+// Sum of |a[k] - b[k]| over n counts.
+static uint64 SumAbsDiff(const uint32* a, const uint32* b, uint32 n) {
+  uint64 sum = 0;
+  for (uint32 k = 0; k < n; k++) sum += a[k] > b[k] ? a[k] - b[k] : b[k] - a[k];
+  return sum;
+}
+
+/// A lower bound of ImageDistance of the images with signatures a and b:
+/// the largest difference of BLACK counts over the grid cells, the row
+/// bins, the column bins or the whole image (only the last one if the
+/// images differ in size).
+uint64 ImageSignatureLowerBound(const ImageSignature* a,
+                                const ImageSignature* b) {  ///
+  assert(a != NULL && b != NULL);
+  uint64 bound = a->black > b->black ? a->black - b->black
+                                     : b->black - a->black;
+  if (a->width != b->width || a->height != b->height) return bound;
+  uint64 grid = SumAbsDiff(a->grid, b->grid, IMAGE_SIG_GRID * IMAGE_SIG_GRID);
+  uint64 rows = SumAbsDiff(a->rows, b->rows, IMAGE_SIG_BINS);
+  uint64 cols = SumAbsDiff(a->cols, b->cols, IMAGE_SIG_BINS);
+  if (grid > bound) bound = grid;
+  if (rows > bound) bound = rows;
+  if (cols > bound) bound = cols;
+  return bound;
+}
+
+/// The MinHash estimate (0 to 1) of the similarity of the run features
+/// of the images with signatures a and b: the fraction of the slots
+/// used by either one where both hold the same value.
+/// (1 if neither has BLACK runs.)
+double ImageSignatureSimilarity(const ImageSignature* a,
+                                const ImageSignature* b) {  ///
+  assert(a != NULL && b != NULL);
+  uint32 used = 0;
+  uint32 same = 0;
+  for (uint32 k = 0; k < IMAGE_SIG_HASHES; k++) {
+    if (a->minhash[k] == UINT32_MAX && b->minhash[k] == UINT32_MAX) continue;
+    used++;
+    same += a->minhash[k] == b->minhash[k];
+  }
+  return used == 0 ? 1.0 : (double)same / used;
+}
+
+// Number of BLACK pixels in columns x and beyond of a RLE row.
+static uint32 BlackFrom(const RLEElem* row, uint32 x) {
+  uint32 count = 0;
+  uint32 pos = 0;
+  int value = row[0];
+  uint32 j;
+  for (j = 1; row[j] != EOR; j++, value ^= 1) {
+    uint32 end = pos + row[j];
+    if (value == BLACK && end > x) count += end - (pos > x ? pos : x);
+    pos = end;
+  }
+  COUNT_PIXMEM(j);
+  return count;
+}
+
+/// Number of differing pixels of img1 and img2, both padded with WHITE to
+/// the largest width and height, counted on the runs.  Counting stops
+/// once it exceeds limit: the result is exact if at most limit, and
+/// above limit otherwise.
+uint64 ImageDistance(const Image img1, const Image img2, uint64 limit) {  ///
+  assert(img1 != NULL && img2 != NULL);
+  uint32 width = img1->width < img2->width ? img1->width : img2->width;
+  uint32 height = img1->height > img2->height ? img1->height : img2->height;
+  // Rows of the wider image are cut to the common width here
+  RLEElem* buffer = img1->width != img2->width ? ScratchRLERow(width) : NULL;
+
+  uint64 count = 0;
+  for (uint32 i = 0; i < height && count <= limit; i++) {
+    const RLEElem* row1 = i < img1->height ? GetRow(img1, i, SCRATCH_ROW1) : NULL;
+    const RLEElem* row2 = i < img2->height ? GetRow(img2, i, SCRATCH_ROW2) : NULL;
+    if (row1 == NULL || row2 == NULL) {
+      count += BlackFrom(row1 != NULL ? row1 : row2, 0);
+      continue;
+    }
+    if (img1->width != img2->width) {
+      const RLEElem** wide = img1->width > width ? &row1 : &row2;
+      count += BlackFrom(*wide, width);
+      uint32 last = 0;
+      PushRuns(buffer, &last, *wide, 0, width);
+      buffer[++last] = EOR;
+      *wide = buffer;
     }
-    // Compress the RAW row and then store it in newImage, then free all the uncompressed rows
-    newImage->row[i] = CompressRow(newImage->width, new_uncompressedRow);
-    free(uncompressedRow_1);
-    free(uncompressedRow_2);
-    free(new_uncompressedRow);
+    uint32 first, last;
+    count += XorRows(row1, row2, NULL, &first, &last);
+  }
+  return count;
+}
+
+/// Boolean Operations on image pixels
+
+/// These functions apply boolean operations to images,
+/// returning a new image as a result.
+///
+/// Operand images are left untouched and must be of the same size.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+Image ImageNEG(const Image img) {
+  assert(img != NULL);
+
+  if (img->gen != NULL) {
+    // Procedural images stay procedural
+    Image newImage = ImageMalloc(sizeof(struct image));
+    *newImage = *img;
+    newImage->invert ^= 1;
+    return newImage;
+  }
+
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  Image newImage = AllocateTiledImageHeader(width, height, img->tile_width);
+
+  // Directly copying the rows (or tiles), one by one
+  // And changing the value of row[k][0]
+
+  size_t num_rows = (size_t)height * img->num_tiles;
+  for (size_t k = 0; k < num_rows; k++) {
+    uint32 num_elems = GetSizeRLERowArray(img->row[k]);
+    newImage->row[k] = AllocateRLERowArray(num_elems);
+    memcpy(newImage->row[k], img->row[k], num_elems * sizeof(RLEElem));
+    newImage->row[k][0] ^= 1;  // Just negate the value of the first pixel run
   }
+
   return newImage;
 }
 
-Image ImageXOR(Image img1, Image img2) {
+Image ImageBinaryOp(const Image img1, const Image img2, unsigned op) {
   assert(img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+  assert(op < 16);
+  // The result keeps the tiles of img1
+  Image newImage = AllocateTiledImageHeader(img1->width, img1->height,
+                                            img1->tile_width);
+  ImageBinaryOpInto(newImage, img1, img2, op);
+  return newImage;
+}
 
-  // COMPLETE THE CODE
-  // You might consider using the UncompressRow and CompressRow auxiliary files
-  // Or devise a more efficient alternative
-  // ...
+Image ImageAND(const Image img1, const Image img2) {
+  return ImageBinaryOp(img1, img2, IMAGE_OP_AND);
+}
 
-  return NULL;
+Image ImageOR(const Image img1, const Image img2) {
+  return ImageBinaryOp(img1, img2, IMAGE_OP_OR);
+}
+
+Image ImageXOR(const Image img1, const Image img2) {
+  return ImageBinaryOp(img1, img2, IMAGE_OP_XOR);
+}
+
+Image ImageANDNOT(const Image img1, const Image img2) {
+  return ImageBinaryOp(img1, img2, IMAGE_OP_ANDNOT);
+}
+
+Image ImageORNOT(const Image img1, const Image img2) {
+  return ImageBinaryOp(img1, img2, IMAGE_OP_ORNOT);
+}
+
+Image ImageNAND(const Image img1, const Image img2) {
+  return ImageBinaryOp(img1, img2, IMAGE_OP_NAND);
+}
+
+Image ImageNOR(const Image img1, const Image img2) {
+  return ImageBinaryOp(img1, img2, IMAGE_OP_NOR);
+}
+
+Image ImageXNOR(const Image img1, const Image img2) {
+  return ImageBinaryOp(img1, img2, IMAGE_OP_XNOR);
+}
+
+Image ImageIMPLIES(const Image img1, const Image img2) {
+  return ImageBinaryOp(img1, img2, IMAGE_OP_IMPLIES);
+}
+
+/// In-place and destination-reuse variants
+
+/// These functions store their result in an existing image,
+/// reusing its row arrays whenever they are large enough.
+/// The destination may be one of the operands.
+
+/// Negate img, in place.
+void ImageNEGInPlace(Image img) {
+  assert(img != NULL);
+  if (img->gen != NULL) {
+    img->invert ^= 1;  // no need to materialize
+    return;
+  }
+  size_t num_rows = (size_t)img->height * img->num_tiles;
+  for (size_t k = 0; k < num_rows; k++) {
+    img->row[k][0] ^= 1;  // Just negate the value of the first pixel run
+  }
+}
+
+// Binary operations on two RLE rows (or tiles) of the same width,
+// storing the result in out (with room for width + 2 elements).
+// They return the number of elements stored.
+typedef uint32 (*RowOp)(uint32 width, const RLEElem* row1, const RLEElem* row2,
+                        RLEElem* out);
+
+// All 16 binary operations share one run-merge engine, MergeRows,
+// parameterized by the truth table of the operation (see IMAGE_OP_AND,
+// etc.).  It is inlined into one function per table, so that the table
+// is a constant: the color of each output segment is a shift and a mask,
+// with no test on the operation.  (PushRun still tests, for each segment,
+// whether it extends the last run.)
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/// Merge two RLE rows of the same width, giving each segment the color
+/// (op >> (2*val1 + val2)) & 1.  Returns the number of elements stored.
+static ALWAYS_INLINE uint32 MergeRows(unsigned op, const RLEElem* row1,
+                                      const RLEElem* row2, RLEElem* out) {
+  uint32 pos = 0;         // start of the current segment
+  int val1 = row1[0];     // colors of the current runs
+  int val2 = row2[0];
+  uint32 i1 = 1, i2 = 1;  // current runs
+  uint32 end1 = row1[1];  // end columns of the current runs
+  uint32 end2 = row2[1];
+  uint32 last = 0;
+  COUNT_PIXMEM(4);
+
+  while (row1[i1] != EOR) {
+    uint32 end = end1 < end2 ? end1 : end2;
+    PushRun(out, &last, (int)((op >> (2 * val1 + val2)) & 1), end - pos);
+    pos = end;
+    // Advance whichever runs end here
+    if (end1 == end) {
+      val1 ^= 1;
+      if (row1[++i1] != EOR) end1 += row1[i1];
+    }
+    if (end2 == end) {
+      val2 ^= 1;
+      if (row2[++i2] != EOR) end2 += row2[i2];
+    }
+  }
+  COUNT_PIXMEM((i1 - 1) + (i2 - 1));  // runs consumed
+  out[++last] = EOR;
+  return last + 1;
+}
+
+#define DEFINE_MERGE(op)                                                  \
+  static uint32 MergeRows##op(uint32 width, const RLEElem* row1,          \
+                              const RLEElem* row2, RLEElem* out) {        \
+    (void)width;                                                          \
+    return MergeRows(op, row1, row2, out);                                \
+  }
+
+DEFINE_MERGE(0)  DEFINE_MERGE(1)  DEFINE_MERGE(2)  DEFINE_MERGE(3)
+DEFINE_MERGE(4)  DEFINE_MERGE(5)  DEFINE_MERGE(6)  DEFINE_MERGE(7)
+DEFINE_MERGE(8)  DEFINE_MERGE(9)  DEFINE_MERGE(10) DEFINE_MERGE(11)
+DEFINE_MERGE(12) DEFINE_MERGE(13) DEFINE_MERGE(14) DEFINE_MERGE(15)
+
+// The specialized merge of each truth table
+static const RowOp merge_ops[16] = {
+  MergeRows0,  MergeRows1,  MergeRows2,  MergeRows3,
+  MergeRows4,  MergeRows5,  MergeRows6,  MergeRows7,
+  MergeRows8,  MergeRows9,  MergeRows10, MergeRows11,
+  MergeRows12, MergeRows13, MergeRows14, MergeRows15,
+};
+
+/// Do img1 and img2 store their rows in the same tiles?
+static int SameTiles(const Image img1, const Image img2) {
+  return img1->gen == NULL && img2->gen == NULL &&
+         img1->tile_width == img2->tile_width &&
+         img1->num_tiles == img2->num_tiles;
+}
+
+/// Store img1 op img2 in dst.
+/// When all three images are tiled alike, the operation is applied tile by
+/// tile (no rows are joined or split); otherwise, row by row.
+static void ApplyRowOp(Image dst, const Image img1, const Image img2,
+                       RowOp op) {
+  assert(dst != NULL && img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+  assert((dst->height == img1->height) && (dst->width == img1->width));
+  Materialize(dst);
+  RLEElem* out = ScratchRLERow(img1->width);
+  if (dst->num_tiles > 1 && SameTiles(dst, img1) && SameTiles(dst, img2)) {
+    size_t num_rows = (size_t)dst->height * dst->num_tiles;
+    for (size_t k = 0; k < num_rows; k++) {
+      uint32 width = TileWidth(dst, (uint32)(k % dst->num_tiles));
+      uint32 size = op(width, img1->row[k], img2->row[k], out);
+      StoreTile(dst, k, out, size);
+    }
+    return;
+  }
+  for (uint32 i = 0; i < img1->height; i++) {
+    uint32 size = op(img1->width, GetRow(img1, i, SCRATCH_ROW1),
+                     GetRow(img2, i, SCRATCH_ROW2), out);
+    StoreRow(dst, i, out, size);
+  }
+}
+
+void ImageBinaryOpInto(Image dst, const Image img1, const Image img2,
+                       unsigned op) {
+  assert(op < 16);
+  ApplyRowOp(dst, img1, img2, merge_ops[op]);
+}
+
+void ImageANDInto(Image dst, const Image img1, const Image img2) {
+  ImageBinaryOpInto(dst, img1, img2, IMAGE_OP_AND);
+}
+
+void ImageORInto(Image dst, const Image img1, const Image img2) {
+  ImageBinaryOpInto(dst, img1, img2, IMAGE_OP_OR);
+}
+
+void ImageXORInto(Image dst, const Image img1, const Image img2) {
+  ImageBinaryOpInto(dst, img1, img2, IMAGE_OP_XOR);
+}
+
+/// N-ary boolean reductions
+
+// The rows of all images are merged in a single left-to-right sweep.
+// A min-heap holds, for each image, the column where its current run
+// ends; at each of those boundaries only the images whose runs end there
+// are advanced.  The number of BLACK images is kept up to date, so each
+// output segment is BLACK when that number reaches the threshold.
+// Cost per row: O(total runs * log n).
+
+// Cursor over the runs of one row
+typedef struct {
+  const RLEElem* row;
+  uint32 i;    // current run
+  uint32 end;  // column after the last pixel of the current run
+  int value;   // color of the current run
+} RunCursor;
+
+// Restore the heap order (by cursor end) going down from position pos.
+static void HeapDown(uint32* heap, uint32 size, const RunCursor* cur,
+                     uint32 pos) {
+  uint32 item = heap[pos];
+  for (;;) {
+    uint32 child = 2 * pos + 1;
+    if (child >= size) break;
+    if (child + 1 < size && cur[heap[child + 1]].end < cur[heap[child]].end)
+      child++;
+    if (cur[heap[child]].end >= cur[item].end) break;
+    heap[pos] = heap[child];
+    pos = child;
+  }
+  heap[pos] = item;
+}
+
+/// Create an image whose pixels are BLACK where at least k of the n images
+/// are BLACK, and WHITE elsewhere.
+/// Requires: n > 0, 1 <= k <= n, all images of the same size.
+/// (k = n gives the AND of all images, k = 1 their OR,
+/// k = n/2+1 a majority vote.)
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageThresholdCount(const Image* imgs, uint32 n, uint32 k) {
+  assert(imgs != NULL && n > 0);
+  assert(k >= 1 && k <= n);
+  uint32 width = imgs[0]->width;
+  uint32 height = imgs[0]->height;
+  for (uint32 j = 1; j < n; j++) {
+    assert(imgs[j] != NULL);
+    assert(imgs[j]->width == width && imgs[j]->height == height);
+  }
+
+  Image newImage = AllocateImageHeader(width, height);
+  RunCursor* cur = ImageMalloc(n * sizeof(RunCursor));
+  uint32* heap = ImageMalloc(n * sizeof(uint32));
+  RLEElem* out = ScratchRLERow(width);
+
+  // Buffers for the rows of procedural and tiled images
+  uint32 num_gen = 0;
+  for (uint32 j = 0; j < n; j++) {
+    num_gen += (imgs[j]->gen != NULL || imgs[j]->num_tiles > 1);
+  }
+  size_t row_size = (size_t)width + 2;
+  RLEElem* gen_rows = num_gen > 0 ? ImageMalloc(num_gen * row_size * sizeof(RLEElem))
+                              : NULL;
+
+  for (uint32 i = 0; i < height; i++) {
+    // Start all cursors on their first run
+    uint32 black = 0;  // number of images that are BLACK at column pos
+    RLEElem* gen_row = gen_rows;
+    for (uint32 j = 0; j < n; j++) {
+      if (imgs[j]->gen != NULL || imgs[j]->num_tiles > 1) {
+        cur[j].row = GetRowInto(imgs[j], i, gen_row);
+        gen_row += row_size;
+      } else {
+        cur[j].row = imgs[j]->row[i];
+      }
+      cur[j].i = 1;
+      cur[j].end = cur[j].row[1];
+      cur[j].value = cur[j].row[0];
+      black += cur[j].value;
+      heap[j] = j;
+    }
+    COUNT_PIXMEM(2 * n);
+    uint32 size = n;
+    for (uint32 j = n / 2; j-- > 0;) HeapDown(heap, size, cur, j);
+
+    uint32 pos = 0;
+    uint32 out_i = 0;
+    uint32 steps = 0;  // runs consumed
+    while (pos < width) {
+      uint32 end = cur[heap[0]].end;
+      PushRun(out, &out_i, black >= k, end - pos);
+      pos = end;
+      // Advance every cursor whose run ends here
+      while (size > 0 && cur[heap[0]].end == end) {
+        RunCursor* c = &cur[heap[0]];
+        black -= c->value;
+        c->value ^= 1;
+        steps++;
+        if (c->row[++c->i] == EOR) {
+          heap[0] = heap[--size];  // row finished
+        } else {
+          c->end += c->row[c->i];
+          black += c->value;
+        }
+        if (size > 0) HeapDown(heap, size, cur, 0);
+      }
+    }
+    COUNT_PIXMEM(steps);
+    out[++out_i] = EOR;
+    StoreRow(newImage, i, out, out_i + 1);
+  }
+
+  ImageFree(cur);
+  ImageFree(heap);
+  ImageFree(gen_rows);
+  return newImage;
+}
+
+/// AND of n images of the same size.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageANDMany(const Image* imgs, uint32 n) {
+  return ImageThresholdCount(imgs, n, n);
+}
+
+/// OR of n images of the same size.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageORMany(const Image* imgs, uint32 n) {
+  return ImageThresholdCount(imgs, n, 1);
 }
 
 /// Geometric transformations
@@ -678,21 +3626,14 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2) {
   uint32 new_height = img1->height + img2->height;
 
   Image newImage = AllocateImageHeader(new_width, new_height);
-  for (uint32 i = 0; i < img1->height; i++) {
-
-    newImage->row[i] = img1->row[i];
-
-  }
-  for (uint32 i = img1->height; i < new_height; i++) {
-
-    newImage->row[i] = img2->row[new_height-img1->height];
-
+  // Each image owns its rows: copy them
+  for (uint32 i = 0; i < new_height; i++) {
+    const RLEElem* row = (i < img1->height)
+                         ? GetRow(img1, i, SCRATCH_ROW1)
+                         : GetRow(img2, i - img1->height, SCRATCH_ROW1);
+    StoreRow(newImage, i, row, GetSizeRLERowArray(row));
   }
 
-
-  // COMPLETE THE CODE (N SEI FAZER ESTA M.)
-  // ...
-
   return newImage;
 }
 
@@ -14,21 +14,28 @@
 #define IMAGEBW_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
 
 // Types for non-negative integer values
 typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
+typedef uint64_t uint64;
 
 // Type Image is a pointer to image objects
 typedef struct image* Image;
 
+// Type ImageRegion is a pointer to allocation regions (see below)
+typedef struct imageRegion* ImageRegion;
+
 // The values for the B and W pixels
 #define BLACK 1  // Black pixel value
 #define WHITE 0  // White pixel value
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of counters.
+/// (Instrumentation is calibrated lazily, by InstrPrint.)
 void ImageInit(void);
 
 /// Image management functions
@@ -59,6 +66,60 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val);
 Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
                             uint8 first_value);
 
+/// Procedural images.
+/// These store no rows: each row is generated from a few parameters when
+/// it is read, so they use constant memory whatever their size.
+/// They may be used wherever an image is expected.  Operations that modify
+/// an image in place turn it into a stored image first (except NEG).
+/// Any width, height and edge lengths are accepted (the last square or
+/// stripe of a row or column may be shorter).
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Image with all pixels of color val.
+Image ImageGenConstant(uint32 width, uint32 height, uint8 val);
+
+/// Chessboard pattern of squares with edge square_edge, the first one of
+/// color first_value.
+Image ImageGenChessboard(uint32 width, uint32 height, uint32 square_edge,
+                         uint8 first_value);
+
+/// Stripes of stripe_width pixels, alternating colors, the first one of
+/// color first_value.  Vertical stripes if vertical != 0, else horizontal.
+Image ImageGenStripes(uint32 width, uint32 height, uint32 stripe_width,
+                      uint8 first_value, int vertical);
+
+/// BLACK grid on WHITE: lines thickness pixels thick, every spacing pixels,
+/// in both directions, starting at (0, 0).
+Image ImageGenGrid(uint32 width, uint32 height, uint32 spacing,
+                   uint32 thickness);
+
+/// BLACK rectangle on WHITE, with top-left corner (x, y) and size
+/// rect_width x rect_height (clipped to the image).
+Image ImageGenRectangle(uint32 width, uint32 height, uint32 x, uint32 y,
+                        uint32 rect_width, uint32 rect_height);
+
+/// Return 1 if img is a procedural image, 0 if its rows are stored.
+int ImageIsProcedural(const Image img);
+
+/// Tiled images.
+/// A tiled image splits each row into column tiles of tile_width pixels
+/// (the last one may be narrower), each with its own RLE run array.
+/// Pixel access, crops and rectangle fills only visit the tiles they
+/// overlap, and AND/OR/XOR of images tiled alike work tile by tile.
+/// All other operations accept tiled images as well.
+
+/// Create a copy of img with tiles of tile_width pixels
+/// (tile_width == 0 or tile_width >= width gives an untiled copy).
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTile(const Image img, uint32 tile_width);
+
+/// Get the tile width of img (0 if img is not tiled).
+uint32 ImageTileWidth(const Image img);
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -66,6 +127,37 @@ Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
 /// Should never fail.
 void ImageDestroy(Image* imgp);
 
+/// Allocation regions.
+/// Each thread has a current allocation context: the heap (initially) or
+/// a region.  Images created while a region is current, and all memory
+/// they later need, are carved from a few large blocks owned by the
+/// region.  Destroying them does nothing: the whole region is released in
+/// one call, images, temporaries and file mappings alike.  Regions suit a
+/// sequence of operations whose intermediates all die together; results
+/// that must outlive the region are promoted out of it.
+/// Images of a region may be used by other threads, but only until it ends.
+
+/// Begin a new region and make it the current allocation context of the
+/// calling thread.  Regions nest: the previous context is restored by
+/// ImageRegionEnd.
+ImageRegion ImageRegionBegin(void);
+
+/// Make region (NULL: the heap) the current allocation context of the
+/// calling thread, and return the previous one, to be restored later.
+/// Use it for images that must outlive the current region.
+ImageRegion ImageRegionUse(ImageRegion region);
+
+/// Copy img out of region, into the context that was current when region
+/// began.  Images not allocated in region are returned unchanged.
+/// (The copy is destroyed as usual, or with its own region.)
+Image ImageRegionPromote(ImageRegion region, const Image img);
+
+/// End the region pointed to by (*regionp), which must be the current
+/// allocation context: release all its images and memory at once, and
+/// restore the context that was current when it began.
+/// Ensures: (*regionp)==NULL.
+void ImageRegionEnd(ImageRegion* regionp);
+
 /// Printing on the console
 
 /// Output the raw BW image
@@ -82,18 +174,197 @@ void ImageRLEPrint(const Image img);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageLoad(const char* filename);
 
+/// Load the next image from a stream of binary PBM images.
+/// A PBM stream (file or pipe) may hold several images, one after the other;
+/// each call reads exactly one of them.
+/// Returns NULL if the end of the stream is reached before any image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadStream(FILE* f);
+
 /// Save image to PBM file.
 /// On success, returns unspecified integer. (No need to check!)
 /// On failure, does not return, EXITS program!
 int ImageSave(const Image img, const char* filename);
 
+/// Write image in PBM format to an open stream (e.g. a pipe or socket).
+/// The stream is not closed, so several images may be written one after
+/// the other, making a multi-image PBM stream.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveStream(const Image img, FILE* f);
+
+/// Load a binary PBM image from the size bytes at data, as found in a
+/// PBM file (e.g. a payload received over the network).
+/// The pixels are decoded straight from data: it is not copied.
+/// Bytes after the image are ignored.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// Invalid or truncated data EXITS the program, like ImageLoad.
+Image ImageLoadFromMemory(const void* data, size_t size);
+
+/// Check that the size bytes at data hold a valid binary PBM image, that
+/// ImageLoadFromMemory decodes without failing (e.g. untrusted payloads).
+/// Returns 1 if they do, 0 otherwise.  Never exits.
+int ImageCheckMemory(const void* data, size_t size);
+
+/// Encode image in PBM format into the capacity bytes at buffer.
+/// Returns the size of the encoding: if it exceeds capacity, nothing is
+/// written, so ImageSaveToMemory(img, NULL, 0) gives the size to allocate.
+size_t ImageSaveToMemory(const Image img, void* buffer, size_t capacity);
+
+/// Save image to PBM file, like ImageSave, with num_threads threads
+/// (0 = one per online CPU) each encoding a range of rows and writing it
+/// at its offset with positioned writes.  The file is preallocated to its
+/// final size first.  The pixmem and allocs counters of the calling thread
+/// include the work of the other threads.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveParallel(const Image img, const char* filename,
+                      int num_threads);
+
+/// Native RLE image file operations
+
+/// These files store the RLE rows as kept in memory, with an index of
+/// row offsets and run counts, so loading them requires no decoding.
+
+/// Save image to a native RLE file.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveRLE(const Image img, const char* filename);
+
+/// Load a native RLE file.
+/// The rows are mapped from the file (mmap), not read or copied.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// Invalid files (header, index or rows) EXIT the program.
+Image ImageLoadRLE(const char* filename);
+
+/// Load rows [first, first+count) of a native RLE file,
+/// as an image of height count.
+/// Only the part of the file holding those rows is touched.
+/// Requires: count > 0 and first+count <= height of the stored image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadRLERows(const char* filename, uint32 first, uint32 count);
+
+/// Check the integrity of a native RLE file (checksums and run data).
+/// Returns 1 if the file is valid, 0 otherwise.
+int ImageCheckRLE(const char* filename);
+
+/// CCITT Group 4 (T.6) image file operations
+
+/// Group 4 is the two-dimensional fax coding of bilevel images, and is
+/// coded directly from and into the RLE rows.  Files are TIFF files
+/// with a single G4 strip; raw bitstreams (no header) may be written
+/// to and read from streams.
+
+/// Save image to a TIFF file with Group 4 compression.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveG4(const Image img, const char* filename);
+
+/// Load a TIFF file with Group 4 compression.
+/// Only single-strip bilevel images are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadG4(const char* filename);
+
+/// Write image as a raw Group 4 bitstream to an open stream.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveG4Stream(const Image img, FILE* f);
+
+/// Load a width x height image from a raw Group 4 bitstream,
+/// read from an open stream up to its end.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadG4Stream(FILE* f, uint32 width, uint32 height);
+
+/// Bitmap buffers
+/// Exchange pixels with other programs through plain bitmaps in memory.
+
+/// Bitmap formats
+#define IMAGE_BITMAP_MSB 0    // 1 bit per pixel, first pixel in bit 7 (PBM)
+#define IMAGE_BITMAP_LSB 1    // 1 bit per pixel, first pixel in bit 0
+#define IMAGE_BITMAP_BYTES 2  // 1 byte per pixel
+
+/// Create an image from the width x height pixels of a bitmap at data,
+/// with rows stride bytes apart, in format.  In 1-bit formats, 1 is BLACK;
+/// in IMAGE_BITMAP_BYTES, 0 is WHITE and anything else is BLACK.
+/// Requires: stride at least the bytes of a row.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageFromBitmap(const void* data, uint32 width, uint32 height,
+                      size_t stride, int format);
+
+/// Write the pixels of img to the bitmap at data, with rows stride bytes
+/// apart, in format (IMAGE_BITMAP_BYTES writes 0 and 1).
+/// Padding bits at the end of 1-bit rows are WHITE (0); bytes between
+/// the end of a row and the next one are left untouched.
+/// Requires: stride at least the bytes of a row.
+void ImageToBitmap(const Image img, void* data, size_t stride, int format);
+
 /// Information queries
 
 /// Get image width
-int ImageWidth(const Image img);
+uint32 ImageWidth(const Image img);
 
 /// Get image height
-int ImageHeight(const Image img);
+uint32 ImageHeight(const Image img);
+
+/// Get the number of bytes of memory used by the image
+/// (image structure, array of row pointers and all RLE row arrays).
+/// Rows mapped from a native RLE file are not counted.
+/// Allocation calls, live bytes and peak bytes for the whole module
+/// are reported through the instrumentation counters.
+size_t ImageMemoryUsage(const Image img);
+
+/// Get the number of runs of the image: the sum of the runs of its rows
+/// (runs that cross tile boundaries count once).
+uint64 ImageNumRuns(const Image img);
+
+/// Release the scratch buffers used by the calling thread for row
+/// conversions.  These buffers only grow, and are reused by all
+/// operations; they are allocated again when needed.
+/// (Functions of this module may run in several threads at once, as long
+/// as no image is changed while another thread uses it.  Instrumentation
+/// counters are per thread.)
+void ImageReleaseScratch(void);
+
+/// Pixel and region access
+
+/// Get the color of pixel (x, y) of img.
+/// Requires: x < width, y < height.
+int ImageGetPixel(const Image img, uint32 x, uint32 y);
+
+/// Crop the rectangle of img with top-left corner (x, y) and size w x h.
+/// The new image has the tiles of img.
+/// Requires: w > 0, h > 0 and the rectangle inside img.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 w, uint32 h);
+
+/// Paint the rectangle of img with top-left corner (x, y) and size w x h
+/// with color val, in place.
+/// Requires: the rectangle inside img, val is either BLACK or WHITE.
+void ImageFillRect(Image img, uint32 x, uint32 y, uint32 w, uint32 h,
+                   uint8 val);
+
+/// Seed fill
+
+/// These work run by run on the RLE rows, never pixel by pixel.
+
+/// Paint the 4-connected region of pixels of the color of pixel (x, y)
+/// that contains it with color val, in place.
+/// Requires: x < width, y < height, val is either BLACK or WHITE.
+void ImageFloodFill(Image img, uint32 x, uint32 y, uint8 val);
+
+/// Paint BLACK the holes of img, in place: the 4-connected WHITE regions
+/// that do not touch the border of the image.
+void ImageFillHoles(Image img);
 
 /// Image comparison
 
@@ -101,6 +372,81 @@ int ImageIsEqual(const Image img1, const Image img2);
 
 int ImageIsDifferent(const Image img1, const Image img2);
 
+/// Summary of the differences between two images
+typedef struct {
+  uint64 count;       // number of differing pixels
+  double percent;     // count, as a percentage of all pixels
+  uint32 xmin, ymin;  // bounding box of the differing pixels (inclusive),
+  uint32 xmax, ymax;  // only meaningful if count > 0
+} ImageDiffResult;
+
+/// Compare two images pixel by pixel, working directly on the RLE rows.
+/// Requires: the images must be of the same size.
+/// If row_counts is not NULL, it must have room for height elements
+/// and receives the number of differing pixels in each row.
+/// If diffp is not NULL, *diffp receives a new image of the differences
+/// (BLACK where the images differ, i.e. img1 XOR img2).
+/// (The caller is responsible for destroying that image!)
+ImageDiffResult ImageDiff(const Image img1, const Image img2,
+                          uint32* row_counts, Image* diffp);
+
+/// Pattern search
+
+/// A position (top-left corner) where a needle image was found in a
+/// haystack image, with the number of differing pixels there.
+typedef struct {
+  uint32 x, y;
+  uint64 mismatch;
+} ImageMatch;
+
+/// Find all the positions where needle matches haystack with at most
+/// max_mismatch differing pixels (Hamming distance), in row-major order.
+/// Offsets are pruned with row fingerprints and black-pixel counts, and
+/// the survivors are verified on the runs, stopping at the limit.
+/// The first capacity positions found are stored in matches (which may
+/// be NULL if capacity is 0).
+/// Returns the number of positions found (possibly more than capacity).
+uint64 ImageFind(const Image haystack, const Image needle,
+                 uint64 max_mismatch, ImageMatch* matches, uint64 capacity);
+
+/// Signatures
+/// Compact, fixed-size summaries of images for similarity search,
+/// computed from the runs in one pass.  They hold no pointers, so they
+/// may be stored in files as they are.
+
+#define IMAGE_SIG_GRID 8     // occupancy grid of GRID x GRID cells
+#define IMAGE_SIG_BINS 32    // bins of each projection profile
+#define IMAGE_SIG_HASHES 32  // MinHash slots
+
+typedef struct {
+  uint32 width, height;
+  uint64 black;  // number of BLACK pixels
+  // Numbers of BLACK pixels (at most UINT32_MAX) in the cells of a grid
+  // (row-major), in bands of rows and in bands of columns
+  uint32 grid[IMAGE_SIG_GRID * IMAGE_SIG_GRID];
+  uint32 rows[IMAGE_SIG_BINS];
+  uint32 cols[IMAGE_SIG_BINS];
+  // MinHash of the BLACK runs (band of rows, column and length class)
+  uint32 minhash[IMAGE_SIG_HASHES];
+} ImageSignature;
+
+/// Compute the signature of img.
+void ImageComputeSignature(const Image img, ImageSignature* sig);
+
+/// A lower bound of ImageDistance of the images with signatures a and b.
+uint64 ImageSignatureLowerBound(const ImageSignature* a,
+                                const ImageSignature* b);
+
+/// The MinHash estimate (0 to 1) of the similarity of the runs of the
+/// images with signatures a and b.
+double ImageSignatureSimilarity(const ImageSignature* a,
+                                const ImageSignature* b);
+
+/// Number of differing pixels of img1 and img2, both padded with WHITE to
+/// the largest width and height.  Counting stops once it exceeds limit:
+/// the result is exact if at most limit, and above limit otherwise.
+uint64 ImageDistance(const Image img1, const Image img2, uint64 limit);
+
 /// Boolean Operations on image pixels
 
 /// These functions apply boolean operations to images,
@@ -119,6 +465,82 @@ Image ImageOR(const Image img1, const Image img2);
 
 Image ImageXOR(const Image img1, const Image img2);
 
+/// img1 AND NOT img2
+Image ImageANDNOT(const Image img1, const Image img2);
+
+/// img1 OR NOT img2
+Image ImageORNOT(const Image img1, const Image img2);
+
+Image ImageNAND(const Image img1, const Image img2);
+
+Image ImageNOR(const Image img1, const Image img2);
+
+Image ImageXNOR(const Image img1, const Image img2);
+
+/// img1 IMPLIES img2, i.e., NOT img1 OR img2
+Image ImageIMPLIES(const Image img1, const Image img2);
+
+/// Any of the 16 binary operations, given by its truth table op:
+/// bit (2*a + b) of op is the result for pixel a of img1 and b of img2.
+/// All operations are computed by a single run-merge engine, specialized
+/// for each table, directly on the RLE rows.
+#define IMAGE_OP_FALSE    0x0
+#define IMAGE_OP_NOR      0x1
+#define IMAGE_OP_NOTAND   0x2  // NOT img1 AND img2
+#define IMAGE_OP_NOT1     0x3  // NOT img1
+#define IMAGE_OP_ANDNOT   0x4  // img1 AND NOT img2
+#define IMAGE_OP_NOT2     0x5  // NOT img2
+#define IMAGE_OP_XOR      0x6
+#define IMAGE_OP_NAND     0x7
+#define IMAGE_OP_AND      0x8
+#define IMAGE_OP_XNOR     0x9
+#define IMAGE_OP_COPY2    0xA  // img2
+#define IMAGE_OP_IMPLIES  0xB  // NOT img1 OR img2
+#define IMAGE_OP_COPY1    0xC  // img1
+#define IMAGE_OP_ORNOT    0xD  // img1 OR NOT img2
+#define IMAGE_OP_OR       0xE
+#define IMAGE_OP_TRUE     0xF
+Image ImageBinaryOp(const Image img1, const Image img2, unsigned op);
+
+/// In-place and destination-reuse variants
+
+/// These functions store their result in an existing image dst,
+/// reusing its row arrays whenever they are large enough
+/// (and growing them only when needed).
+/// dst must be of the same size as the operands, and may be one of them.
+
+/// Negate img, in place.
+void ImageNEGInPlace(Image img);
+
+void ImageANDInto(Image dst, const Image img1, const Image img2);
+
+void ImageORInto(Image dst, const Image img1, const Image img2);
+
+void ImageXORInto(Image dst, const Image img1, const Image img2);
+
+/// Store img1 op img2 in dst, for the truth table op (see ImageBinaryOp).
+void ImageBinaryOpInto(Image dst, const Image img1, const Image img2,
+                       unsigned op);
+
+/// N-ary boolean reductions
+
+/// These functions combine n images of the same size (n > 0)
+/// in a single pass over their runs, without intermediate images.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// AND of the n images imgs[0], ..., imgs[n-1].
+Image ImageANDMany(const Image* imgs, uint32 n);
+
+/// OR of the n images imgs[0], ..., imgs[n-1].
+Image ImageORMany(const Image* imgs, uint32 n);
+
+/// Pixels are BLACK where at least k of the n images are BLACK.
+/// Requires: 1 <= k <= n.
+/// (k = n gives the AND, k = 1 the OR, k = n/2+1 a majority vote.)
+Image ImageThresholdCount(const Image* imgs, uint32 n, uint32 k);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
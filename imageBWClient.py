@@ -0,0 +1,81 @@
+# Send a pipeline of operations to an imageBWTool server.
+# Usage: python3 imageBWClient.py SOCKET [-i FILE]... [-o FILE]... OPERATION...
+# Prints the log of the server.  Images returned by "send" are written
+# to the FILEs given with -o, in order (or to stdout, if none is left).
+# The PBM FILEs given with -i are sent after the request, in order:
+# the operation "-" loads the next one (from memory, not from a file).
+#
+# Start the server with:  ./imageBWTool serve SOCKET
+
+import socket
+import sys
+
+
+def request(sockpath, args, payloads=()):
+    """Run the pipeline args on the server, yield log lines and images.
+    payloads are PBM images (bytes), loaded by the operation "-"."""
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.connect(sockpath)
+        s.sendall(b"".join(a.encode() + b"\0" for a in args) + b"\0")
+        for data in payloads:
+            s.sendall(b"#PBM %d\n" % len(data) + data)
+        s.shutdown(socket.SHUT_WR)  # no more input: "-" past the end fails
+        f = s.makefile("rb")
+        while True:
+            line = f.readline()
+            if not line:
+                raise EOFError("connection closed before #END")
+            if line.startswith(b"#PBM "):
+                size = int(line.split()[1])
+                yield "image", f.read(size)
+            elif line.startswith(b"#END "):
+                _, code, message = line.decode().rstrip("\n").split(" ", 2)
+                yield "end", (int(code), message)
+                return
+            else:
+                yield "log", line.decode(errors="replace")
+
+
+def main(args):
+    if len(args) < 3:
+        print(f"python3 {args[0]} SOCKET [-i FILE]... [-o FILE]... "
+              "OPERATION...")
+        return 1
+
+    sockpath = args[1]
+    outputs = []
+    payloads = []
+    ops = []
+    i = 2
+    while i < len(args):
+        if args[i] == "-o" and i + 1 < len(args):
+            outputs.append(args[i + 1])
+            i += 2
+        elif args[i] == "-i" and i + 1 < len(args):
+            with open(args[i + 1], "rb") as f:
+                payloads.append(f.read())
+            i += 2
+        else:
+            ops.append(args[i])
+            i += 1
+
+    status = 0
+    for kind, value in request(sockpath, ops, payloads):
+        if kind == "log":
+            sys.stdout.write(value)
+        elif kind == "image":
+            if outputs:
+                with open(outputs.pop(0), "wb") as out:
+                    out.write(value)
+            else:
+                sys.stdout.flush()
+                sys.stdout.buffer.write(value)
+        else:
+            status, message = value
+            if status != 0:
+                print(message, file=sys.stderr)
+    return status
+
+
+if __name__ == "__main__":
+    exit(main(sys.argv))
@@ -11,15 +11,27 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "imageBW.h"
+#include "imageIndex.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
     "USAGE: imageTool [FILE...] [OPERATION [OPERAND]]...\n"
+    "       imageTool serve SOCKET[,MB]\n"
+    "       imageTool frames INFILE OUTFILE [OPERATION [OPERAND]]...\n"
+    "       imageTool index INDEX FILE...\n"
+    "       imageTool query INDEX K[,S] FILE\n"
     "  Apply pipeline of image processing operations to PBM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,31 +41,120 @@ static const char* USAGE =
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
+    "FRAMES MODE:\n"
+    "  frames INFILE OUTFILE ...  For each image (frame) of the multi-image PBM\n"
+    "  file INFILE, load it as I0, apply the pipeline, and append CURR to the\n"
+    "  multi-image PBM file OUTFILE.  \"-\" is the standard input or output.\n"
+    "\n"
+    "INDEX MODE:\n"
+    "  index INDEX FILE...  Add the signatures of the image FILEs to the\n"
+    "  near-duplicate index file INDEX (created if it does not exist).\n"
+    "  query INDEX K[,S] FILE  Show the K images of INDEX nearest to FILE\n"
+    "  (fewest differing pixels, padding with WHITE if sizes differ).\n"
+    "  Candidates are ranked by signature (occupancy grid, projection\n"
+    "  profiles, MinHash of the runs) and verified on the images.\n"
+    "  With S > 0, images whose run features are less than S% similar\n"
+    "  (MinHash estimate) are skipped: faster, but no longer exact.\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  serve SOCKET[,MB]  Listen on Unix domain socket SOCKET.\n"
+    "  Each connection sends one pipeline, as NUL-terminated arguments followed\n"
+    "  by an empty argument, and receives its log, ending with a line\n"
+    "  \"#END CODE MESSAGE\".  Loaded images are kept in an LRU cache of up to\n"
+    "  MB megabytes (default 256) and reused while the file is unchanged.\n"
+    "  PBM images may follow the request, each after a line \"#PBM SIZE\":\n"
+    "  the operation \"-\" loads the next one.  See imageBWClient.py.\n"
+    "\n"
     "FILES:\n"
-    "  Currently, only image files in binary PBM format are accepted.\n"
+    "  Image files in binary PBM format and native RLE files are accepted.\n"
+    "  Files with names ending in .rle are native RLE files.\n"
+    "  Files with names ending in .tif or .tiff are Group 4 TIFF files.\n"
     "  Input file names must be distinct from operation names.\n"
+    "  The file name \"-\" loads the next PBM image of the standard input, or\n"
+    "  saves in PBM format to the standard output (the log then goes to\n"
+    "  the standard error).\n"
+    "  Input files are decoded ahead of use and saves are written by background\n"
+    "  threads, overlapping I/O with computation (not in pipelines with tic,\n"
+    "  toc or repeat, so that these measure the operations alone).\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load image from PBM file named FILE.\n"
-    "  save FILE       Save CURR to PBM file named FILE.\n"
-    "  info            Show information on CURR (size).\n"
+    "  save FILE       Save CURR to PBM (or native RLE) file named FILE.\n"
+    "  psave T FILE    Save CURR to PBM file FILE with T threads (0 = one per\n"
+    "                  CPU) encoding ranges of rows, written at their offsets.\n"
+    "  loadrows Y,H FILE\n"
+    "                  Load rows Y to Y+H-1 of native RLE file FILE.\n"
+    "  checkrle FILE   Check integrity of native RLE file FILE.\n"
+    "  send            Send CURR as PBM bytes to the client (server mode),\n"
+    "                  after a line \"#PBM SIZE\".\n"
+    "  quit            Stop the server after this request (server mode).\n"
+    "  info            Show information on CURR (size, memory).\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  repeat R[,U] ... end\n"
+    "                  Run the operations up to end U times (warmup) and then\n"
+    "                  R times, reporting min/median/p90/p99/max time and\n"
+    "                  throughput at the median time: pixels/s and runs/s\n"
+    "                  (of PREV and CURR before the block and of the images\n"
+    "                  it creates), and iterations per second (iter/s).\n"
+    "                  Images created inside are destroyed between\n"
+    "                  iterations (the last ones are kept).\n"
     "\n"              
     "  create W,H,C    Create new image with WxH pixels, color C.\n"
-    "  chess W,H,E,C   Create new chessboard image with WxH pixels,"
+    "  chess W,H,E,C   Create new chessboard image with WxH pixels,\n"
     "                  squares with edge E, first color C.\n"
+    "  gconst W,H,C    Procedural versions of create and chess: rows are\n"
+    "  gchess W,H,E,C  generated when read, not stored.\n"
+    "  gstripes W,H,E,C,V\n"
+    "                  Procedural stripes of width E, first color C,\n"
+    "                  vertical if V = 1, horizontal if V = 0.\n"
+    "  ggrid W,H,E,T   Procedural BLACK grid on WHITE, lines of thickness T\n"
+    "                  every E pixels.\n"
+    "  grect W,H,X,Y,RW,RH\n"
+    "                  Procedural BLACK RWxRH rectangle at (X,Y) on WHITE.\n"
     "\n"              
     "  raw             Print RAW representation of CURR.\n"
     "  rle             Print RLE representation of CURR.\n"
     "\n"              
     "  equal           PREV == CURR?\n"
+    "  diff            Compare PREV and CURR: show number and percentage of\n"
+    "                  differing pixels, their bounding box and per-row counts,\n"
+    "                  and create the difference image (PREV xor CURR).\n"
+    "                  Images of different sizes are an error.  As with\n"
+    "                  imageDiff.py, the exit status is 1 if any pixels differ.\n"
+    "  find M          Find the positions where CURR matches PREV with at most\n"
+    "                  M differing pixels.\n"
     "\n"              
     "  neg             Neg CURR.\n"
     "  and             PREV and CURR.\n"
     "  or              PREV or CURR.\n"
     "  xor             PREV xor CURR.\n"
+    "  andnot ornot    PREV and not CURR, PREV or not CURR.\n"
+    "  nand nor xnor   PREV nand/nor/xnor CURR.\n"
+    "  implies         PREV implies CURR (not PREV or CURR).\n"
+    "  bool T          Binary operation with truth table T (0 to 15):\n"
+    "                  bit 2*P+C of T is the result for pixels P of PREV and\n"
+    "                  C of CURR (e.g. 8 = and, 14 = or, 6 = xor).\n"
+    "  andmany M       AND of the last M images.\n"
+    "  ormany M        OR of the last M images.\n"
+    "  threshold M,K   BLACK where at least K of the last M images are BLACK.\n"
+    "  neg!            Neg CURR, in place (no new image).\n"
+    "  and! or! xor!   PREV op CURR, stored in CURR (no new image).\n"
     "\n"              
+    "  tile TW         Copy CURR with rows split into tiles of TW pixels\n"
+    "                  (TW = 0: untiled copy).\n"
+    "  bitmap F        Copy CURR through a bitmap in memory, with ImageToBitmap\n"
+    "                  and ImageFromBitmap, in format F: msb or lsb (1 bit per\n"
+    "                  pixel, first in the high or low bit) or bytes.\n"
+    "  pixel X,Y       Show the color of pixel (X,Y) of CURR.\n"
+    "  crop X,Y,W,H    Crop the WxH rectangle of CURR at (X,Y).\n"
+    "  fill X,Y,W,H,C  Paint the WxH rectangle of CURR at (X,Y) with color C,\n"
+    "                  in place.\n"
+    "  flood X,Y,C     Paint the region of CURR connected to pixel (X,Y) with\n"
+    "                  color C, in place.\n"
+    "  holes           Paint BLACK the WHITE regions of CURR that do not touch\n"
+    "                  its border, in place.\n"
+    "\n"
     "  hmirror         Horizontal mirror CURR (flip top-bottom).\n"
     "  vmirror         Vertical mirror CURR (flip left-right).\n"
     "  repb            Replicate CURR at the bottom of PREV.\n"
@@ -62,8 +163,11 @@ static const char* USAGE =
     "OPERANDS:\n"
     "  FILE            A filename\n"
     "  W,H             Width and height of image or rectangular region.\n"
+    "  Y,H             First row and number of rows.\n"
     "  C               Color (0 = WHITE, 1 = BLACK).\n"
     "  E               Edge length.\n"
+    "  M,K             Number of images, threshold.\n"
+    "  X,Y             Column and row of a pixel or corner.\n"
     "\n"
     ;
 
@@ -73,9 +177,1141 @@ static char* errors[] = {
   "Insufficient images",
   "Insufficient space in buffer",
   "Invalid operand",
+  "Unmatched repeat/end",
+  "Cannot open file",
+  "Only available in server mode",
+  "Images of different sizes",
 };
 
 
+// The image buffer
+#define N 10          // buffer capacity
+static Image img[N];  // the images
+static int n = 0;     // number of images created
+
+static FILE* log;     // where to send log messages
+
+static int differ = 0;  // did a diff find differing pixels? (exit status 1)
+
+// Does the filename denote a native RLE file?
+static int isRLEFile(const char* filename) {
+  size_t len = strlen(filename);
+  return len > 4 && strcmp(filename + len - 4, ".rle") == 0;
+}
+
+// Is filename a Group 4 TIFF file (by its extension)?
+static int isG4File(const char* filename) {
+  size_t len = strlen(filename);
+  return (len > 4 && strcmp(filename + len - 4, ".tif") == 0) ||
+         (len > 5 && strcmp(filename + len - 5, ".tiff") == 0);
+}
+
+// Does the filename denote the standard input or output ("-")?
+static int isStdio(const char* filename) {
+  return strcmp(filename, "-") == 0;
+}
+
+// Load an image file, choosing the format from the filename.
+// "-" reads the next PBM image from the standard input (NULL at its end).
+static Image loadFile(const char* filename) {
+  if (isStdio(filename)) return ImageLoadStream(stdin);
+  if (isRLEFile(filename)) return ImageLoadRLE(filename);
+  if (isG4File(filename)) return ImageLoadG4(filename);
+  return ImageLoad(filename);
+}
+
+// Get the truth table of the binary operation named name (other than
+// and, or, xor), or -1 if there is none.
+static int binaryOp(const char* name) {
+  static const struct {
+    const char* name;
+    int op;
+  } ops[] = {
+    {"andnot", IMAGE_OP_ANDNOT}, {"ornot", IMAGE_OP_ORNOT},
+    {"nand", IMAGE_OP_NAND},     {"nor", IMAGE_OP_NOR},
+    {"xnor", IMAGE_OP_XNOR},     {"implies", IMAGE_OP_IMPLIES},
+  };
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strcmp(name, ops[i].name) == 0) return ops[i].op;
+  }
+  return -1;
+}
+
+// Save image to a file, choosing the format from the filename.
+// "-" writes it in PBM format to the standard output.
+static void saveFile(const Image image, const char* filename) {
+  if (isStdio(filename)) {
+    ImageSaveStream(image, stdout);
+    fflush(stdout);
+  } else if (isRLEFile(filename)) ImageSaveRLE(image, filename);
+  else if (isG4File(filename)) ImageSaveG4(image, filename);
+  else ImageSave(image, filename);
+}
+
+// Background I/O (command line pipelines only)
+//
+// Before running a pipeline, main scans it for the input files it names.
+// A loader thread reads them in order, up to PREFETCH images ahead of
+// the operation that uses them, while the main thread computes.
+// The loader never exits the program: it decodes only PBM files that
+// ImageCheckMemory accepts, and leaves the others (other formats, bad
+// files, read errors) to the main thread, which loads them from the file
+// (now in the page cache) when the pipeline reaches them and reports any
+// error there, after the saves queued before.
+// Saves are queued to a writer thread, which performs them in order.
+// Images queued for saving must not be changed or destroyed until they
+// are written: see waitSaves.
+// Background I/O is off when the pipeline uses tic, toc or repeat, so
+// that counters and times measure the operations alone.
+
+#define PREFETCH 2  // images decoded ahead of use
+
+enum { PENDING, LOADED, LEFT };
+
+typedef struct {
+  const char* path;  // file to load
+  int arg;           // index of path in the arguments
+  int state;         // PENDING, LOADED or LEFT (to the main thread)
+  Image img;         // the image, once LOADED
+} Prefetch;
+
+typedef struct SaveJob {
+  Image img;
+  const char* path;
+  struct SaveJob* next;
+} SaveJob;
+
+static int background = 0;  // is background I/O on?
+static int io_stop = 0;     // should the I/O threads finish?
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t loader, writer;
+
+static Prefetch* prefetch = NULL;  // input files, in pipeline order
+static int num_prefetch = 0;
+static int next_load = 0;  // next entry for the loader thread
+static int next_use = 0;   // next entry for the main thread
+
+static SaveJob* save_head = NULL;  // queue of saves
+static SaveJob* save_tail = NULL;
+static Image saving = NULL;        // image being written, or NULL
+
+// Read the whole file path into a new buffer, and its size into *sizep.
+// Returns NULL on failure (errors are left to the main thread).
+static char* readFile(const char* path, size_t* sizep) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return NULL;
+  size_t size = 0;
+  size_t cap = 1 << 16;
+  char* data = malloc(cap);
+  while (data != NULL) {
+    size += fread(data + size, 1, cap - size, f);
+    if (size < cap) break;
+    cap *= 2;
+    char* bigger = realloc(data, cap);
+    if (bigger == NULL) free(data);
+    data = bigger;
+  }
+  if (data != NULL && ferror(f)) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  *sizep = size;
+  return data;
+}
+
+static void* loaderMain(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&io_lock);
+  while (!io_stop && next_load < num_prefetch) {
+    if (next_load - next_use >= PREFETCH) {
+      pthread_cond_wait(&io_cond, &io_lock);
+      continue;
+    }
+    Prefetch* p = &prefetch[next_load];
+    pthread_mutex_unlock(&io_lock);
+    size_t size;
+    char* data = readFile(p->path, &size);
+    Image image = NULL;
+    if (data != NULL && !isRLEFile(p->path) && !isG4File(p->path) &&
+        ImageCheckMemory(data, size)) {
+      image = ImageLoadFromMemory(data, size);
+    }
+    free(data);
+    pthread_mutex_lock(&io_lock);
+    p->img = image;
+    p->state = image != NULL ? LOADED : LEFT;
+    next_load++;
+    pthread_cond_broadcast(&io_cond);
+  }
+  pthread_mutex_unlock(&io_lock);
+  ImageReleaseScratch();
+  return NULL;
+}
+
+static void* writerMain(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&io_lock);
+  for (;;) {
+    if (save_head == NULL) {
+      if (io_stop) break;
+      pthread_cond_wait(&io_cond, &io_lock);
+      continue;
+    }
+    SaveJob* job = save_head;
+    save_head = job->next;
+    if (save_head == NULL) save_tail = NULL;
+    saving = job->img;
+    pthread_mutex_unlock(&io_lock);
+    saveFile(job->img, job->path);
+    pthread_mutex_lock(&io_lock);
+    saving = NULL;
+    free(job);
+    pthread_cond_broadcast(&io_cond);
+  }
+  pthread_mutex_unlock(&io_lock);
+  ImageReleaseScratch();
+  return NULL;
+}
+
+// Is a save of image (of any image, if NULL) queued or in progress?
+// (Call with io_lock held.)
+static int savePending(const Image image) {
+  if (saving != NULL && (image == NULL || saving == image)) return 1;
+  for (SaveJob* job = save_head; job != NULL; job = job->next) {
+    if (image == NULL || job->img == image) return 1;
+  }
+  return 0;
+}
+
+// Wait until all saves of image (of all images, if NULL) are written.
+static void waitSaves(const Image image) {
+  if (!background) return;
+  pthread_mutex_lock(&io_lock);
+  while (savePending(image)) pthread_cond_wait(&io_cond, &io_lock);
+  pthread_mutex_unlock(&io_lock);
+}
+
+// Queue image to be saved to filename by the writer thread.
+static void queueSave(Image image, const char* filename) {
+  SaveJob* job = malloc(sizeof(SaveJob));
+  if (job == NULL) { perror("malloc"); exit(errno); }
+  job->img = image;
+  job->path = filename;
+  job->next = NULL;
+  pthread_mutex_lock(&io_lock);
+  if (save_tail != NULL) save_tail->next = job;
+  else save_head = job;
+  save_tail = job;
+  pthread_cond_broadcast(&io_cond);
+  pthread_mutex_unlock(&io_lock);
+}
+
+// Get the image of the input file in argument arg, if it was prefetched.
+// Returns NULL if the file must be loaded by the caller.
+static Image takePrefetched(int arg) {
+  if (!background) return NULL;
+  Image image = NULL;
+  pthread_mutex_lock(&io_lock);
+  if (next_use < num_prefetch && prefetch[next_use].arg == arg) {
+    Prefetch* p = &prefetch[next_use];
+    while (p->state == PENDING) pthread_cond_wait(&io_cond, &io_lock);
+    image = p->img;
+    p->img = NULL;
+    next_use++;
+    pthread_cond_broadcast(&io_cond);
+  }
+  pthread_mutex_unlock(&io_lock);
+  return image;
+}
+
+// Number of operands of operation name, or -1 if name is not an
+// operation (and therefore a file name).  Must agree with Operation.
+static int numOperands(const char* name) {
+  static const char* one[] = {
+    "save", "checkrle", "repeat", "create", "chess", "gconst", "gchess",
+    "gstripes", "ggrid", "grect", "andmany", "ormany", "threshold", "tile",
+    "bitmap", "pixel", "crop", "fill", "flood", "find", "bool", NULL
+  };
+  static const char* none[] = {
+    "send", "quit", "info", "tic", "toc", "end", "raw", "rle", "equal",
+    "diff", "neg", "neg!", "and", "or", "xor", "and!", "or!", "xor!",
+    "hmirror", "vmirror", "repb", "repr", "holes", "andnot", "ornot",
+    "nand", "nor", "xnor", "implies", NULL
+  };
+  if (strcmp(name, "loadrows") == 0 || strcmp(name, "psave") == 0) return 2;
+  for (int i = 0; one[i] != NULL; i++)
+    if (strcmp(name, one[i]) == 0) return 1;
+  for (int i = 0; none[i] != NULL; i++)
+    if (strcmp(name, none[i]) == 0) return 0;
+  return -1;
+}
+
+// Does the pipeline av[1..ac) measure itself (tic, toc or repeat)?
+static int isMeasured(int ac, char* av[]) {
+  for (int k = 1; k < ac; k++) {
+    if (strcmp(av[k], "tic") == 0 || strcmp(av[k], "toc") == 0 ||
+        strcmp(av[k], "repeat") == 0) return 1;
+  }
+  return 0;
+}
+
+// Scan the pipeline av[1..ac) and start the background I/O threads.
+// Files written by an earlier save are not prefetched.
+static void startBackgroundIO(int ac, char* av[]) {
+  if (isMeasured(ac, av)) return;
+  prefetch = malloc(ac * sizeof(Prefetch));
+  if (prefetch == NULL) { perror("malloc"); exit(errno); }
+  for (int k = 1; k < ac; k++) {
+    int m = numOperands(av[k]);
+    if (m >= 0) {
+      k += m;
+      continue;
+    }
+    int written = 0;
+    for (int j = 1; j < k && !written; j++) {
+      written = (strcmp(av[j], "save") == 0 && strcmp(av[j+1], av[k]) == 0) ||
+                (strcmp(av[j], "psave") == 0 && j + 2 < k &&
+                 strcmp(av[j+2], av[k]) == 0);
+    }
+    if (written || isStdio(av[k])) continue;
+    Prefetch* p = &prefetch[num_prefetch++];
+    p->path = av[k];
+    p->arg = k;
+    p->state = PENDING;
+    p->img = NULL;
+  }
+  background = 1;
+  if (pthread_create(&loader, NULL, loaderMain, NULL) != 0 ||
+      pthread_create(&writer, NULL, writerMain, NULL) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+}
+
+// Finish the queued saves and stop the background I/O threads.
+static void stopBackgroundIO(void) {
+  if (!background) return;
+  pthread_mutex_lock(&io_lock);
+  io_stop = 1;
+  pthread_cond_broadcast(&io_cond);
+  pthread_mutex_unlock(&io_lock);
+  pthread_join(loader, NULL);
+  pthread_join(writer, NULL);
+  for (int i = next_use; i < next_load; i++) {
+    if (prefetch[i].img != NULL) ImageDestroy(&prefetch[i].img);
+  }
+  free(prefetch);
+  background = 0;
+}
+
+// Server mode
+
+static int serving = 0;   // running as a server?
+static int quitting = 0;  // stop serving after current request?
+
+// Input of the current request after its arguments: PBM payloads, each
+// one a line "#PBM SIZE" followed by SIZE bytes (see imageBWClient.py -i),
+// loaded by the operation "-".
+static int req_conn = -1;       // connection of the current request
+static char* req_extra = NULL;  // bytes already read past the arguments
+static size_t req_extra_len = 0;
+
+// Read size bytes of the current request input into dst.
+// Returns 0 on success, -1 if the input ends first.
+static int recvBytes(void* dst, size_t size) {
+  size_t m = size < req_extra_len ? size : req_extra_len;
+  memcpy(dst, req_extra, m);
+  req_extra += m;
+  req_extra_len -= m;
+  for (size_t done = m; done < size;) {
+    ssize_t got = read(req_conn, (char*)dst + done, size - done);
+    if (got <= 0) return -1;
+    done += (size_t)got;
+  }
+  return 0;
+}
+
+// Receive the next PBM payload of the current request and decode it
+// straight from the receive buffer.  Returns NULL if there is none,
+// or if it is not a valid PBM image (checked first: a bad payload must
+// fail the request, not end the server).
+static Image recvImage(void) {
+  char line[32];
+  size_t len = 0;
+  for (;;) {
+    if (len == sizeof(line) - 1 || recvBytes(&line[len], 1) != 0) return NULL;
+    if (line[len] == '\n') break;
+    len++;
+  }
+  line[len] = '\0';
+  size_t size;
+  if (sscanf(line, "#PBM %zu", &size) != 1) return NULL;
+  char* data = malloc(size);
+  if (data == NULL) { perror("malloc"); exit(errno); }
+  Image image = NULL;
+  if (recvBytes(data, size) == 0 && ImageCheckMemory(data, size)) {
+    image = ImageLoadFromMemory(data, size);
+  }
+  free(data);
+  return image;
+}
+
+// Library functions EXIT the program on bad files and I/O errors.
+// The server runs those calls in a child process, so that a bad request
+// fails alone: runJob runs job(arg) in a child and waits for it, and
+// returns 1 if it finished normally (0 if it exited with an error or
+// was killed by an assertion).  Otherwise, job(arg) runs here.
+static int runJob(void (*job)(void*), void* arg) {
+  if (!serving) {
+    job(arg);
+    return 1;
+  }
+  fflush(NULL);  // the child must not write our buffered output again
+  pid_t pid = fork();
+  if (pid < 0) { perror("fork"); exit(errno); }
+  if (pid == 0) {
+    job(arg);
+    fflush(NULL);
+    _exit(0);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) { perror("waitpid"); exit(errno); }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+typedef struct {
+  const char* path;
+  uint32 first, count;  // rows of a RLE file (count 0 = whole file)
+  Image img;            // to save
+  int threads;          // for ImageSaveParallel (-1 = saveFile)
+} Job;
+
+// Load a file, to find whether it loads (images are made in the child).
+static void loadJob(void* arg) {
+  Job* job = arg;
+  if (job->count == 0) loadFile(job->path);
+  else ImageLoadRLERows(job->path, job->first, job->count);
+}
+
+static void saveJob(void* arg) {
+  Job* job = arg;
+  if (job->threads < 0) saveFile(job->img, job->path);
+  else ImageSaveParallel(job->img, job->path, job->threads);
+}
+
+static void checkRLEJob(void* arg) {
+  Job* job = arg;
+  int ok = ImageCheckRLE(job->path);
+  fprintf(log, "ImageCheckRLE(\"%s\") -> %d\n", job->path, ok);
+}
+
+// Cache of loaded images, kept in a doubly linked list in LRU order.
+// Images in the buffer that came from the cache are borrowed (pinned):
+// they are released, not destroyed, and are never evicted while in use.
+typedef struct CacheEntry {
+  char* path;
+  time_t mtime;  // file identity when loaded
+  off_t size;
+  ino_t ino;
+  Image img;
+  size_t bytes;  // memory used by img
+  int pins;      // number of buffer slots using img
+  struct CacheEntry* prev;
+  struct CacheEntry* next;
+} CacheEntry;
+
+static CacheEntry* cache_head = NULL;  // most recently used
+static CacheEntry* cache_tail = NULL;  // least recently used
+static size_t cache_bytes = 0;         // memory used by cached images
+static size_t cache_capacity = 256u << 20;
+
+static CacheEntry* cached[N];  // cache entry of each buffer image, or NULL
+
+static void cacheUnlink(CacheEntry* e) {
+  if (e->prev != NULL) e->prev->next = e->next; else cache_head = e->next;
+  if (e->next != NULL) e->next->prev = e->prev; else cache_tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void cachePushFront(CacheEntry* e) {
+  e->prev = NULL;
+  e->next = cache_head;
+  if (cache_head != NULL) cache_head->prev = e; else cache_tail = e;
+  cache_head = e;
+}
+
+static void cacheRemove(CacheEntry* e) {
+  cacheUnlink(e);
+  cache_bytes -= e->bytes;
+  ImageDestroy(&e->img);
+  free(e->path);
+  free(e);
+}
+
+// Evict unpinned entries, least recently used first, until within capacity.
+static void cacheEvict(void) {
+  CacheEntry* e = cache_tail;
+  while (e != NULL && cache_bytes > cache_capacity) {
+    CacheEntry* prev = e->prev;
+    if (e->pins == 0) cacheRemove(e);
+    e = prev;
+  }
+}
+
+// Get image from file, reusing the cached copy if the file is unchanged.
+// The returned entry is pinned.  Returns NULL if the file cannot be stat'ed
+// or loaded (a new file is first loaded by a child process: see runJob).
+static CacheEntry* cacheLoad(const char* path, int* hit) {
+  struct stat st;
+  if (stat(path, &st) != 0) return NULL;
+
+  CacheEntry* e = cache_head;
+  while (e != NULL && strcmp(e->path, path) != 0) e = e->next;
+  if (e != NULL && (e->mtime != st.st_mtime || e->size != st.st_size ||
+                    e->ino != st.st_ino)) {
+    // Stale: drop it now, or just forget it if someone still uses it
+    if (e->pins == 0) {
+      cacheRemove(e);
+    } else {
+      cacheUnlink(e);
+      e->path[0] = '\0';  // unreachable, destroyed when unpinned
+      e->prev = e->next = e;
+    }
+    e = NULL;
+  }
+
+  *hit = (e != NULL);
+  if (e != NULL) {
+    cacheUnlink(e);
+  } else {
+    Job probe = {path, 0, 0, NULL, 0};
+    if (!runJob(loadJob, &probe)) return NULL;
+    e = malloc(sizeof(*e));
+    if (e == NULL || (e->path = strdup(path)) == NULL) {
+      perror("malloc");
+      exit(errno);
+    }
+    ImageRegion request = ImageRegionUse(NULL);  // cached beyond the request
+    e->img = loadFile(path);
+    ImageRegionUse(request);
+    e->mtime = st.st_mtime;
+    e->size = st.st_size;
+    e->ino = st.st_ino;
+    e->bytes = ImageMemoryUsage(e->img);
+    e->pins = 0;
+    cache_bytes += e->bytes;
+  }
+  cachePushFront(e);
+  e->pins++;
+  cacheEvict();
+  return e;
+}
+
+// Release the image at the end of the buffer (CURR).
+// Owned images are destroyed, cached images are unpinned.
+static void dropImage(void) {
+  assert(n > 0);
+  n--;
+  CacheEntry* e = cached[n];
+  cached[n] = NULL;
+  if (e == NULL) {
+    waitSaves(img[n]);
+    ImageDestroy(&img[n]);
+    return;
+  }
+  img[n] = NULL;
+  e->pins--;
+  if (e->prev == e) {  // stale entry, no longer in the list
+    if (e->pins == 0) {
+      cache_bytes -= e->bytes;
+      ImageDestroy(&e->img);
+      free(e->path);
+      free(e);
+    }
+    return;
+  }
+  cacheEvict();
+}
+
+static int Operation(int ac, char* av[], int* k);
+
+// Are w and h valid image dimensions?
+static int validSize(uint32 w, uint32 h) {
+  return w > 0 && h > 0 && w < UINT32_MAX;
+}
+
+// Do the last m images of the buffer all have the same size?
+static int sameSize(int m) {
+  assert(m >= 1 && m <= n);
+  for (int i = n - m + 1; i < n; i++) {
+    if (ImageWidth(img[i]) != ImageWidth(img[n-m]) ||
+        ImageHeight(img[i]) != ImageHeight(img[n-m])) return 0;
+  }
+  return 1;
+}
+
+// Compare doubles, for qsort
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Get the p-th percentile (0 < p <= 1) of n sorted values (nearest rank).
+static double percentile(const double* sorted, uint32 n, double p) {
+  uint32 rank = (uint32)(p * n + 0.999999);
+  if (rank < 1) rank = 1;
+  return sorted[rank - 1];
+}
+
+// Run the operations in av[*k+1 .. end) warmup+runs times and report
+// statistics on the time taken by the last runs iterations.
+// Images created by these operations are destroyed between iterations,
+// those of the last iteration are kept in the buffer.
+// On return, *k is the index of the matching "end".
+static int Repeat(char* av[], int* k, int end, uint32 runs, uint32 warmup) {
+  double* times = malloc(runs * sizeof(double));
+  if (times == NULL) { perror("malloc"); exit(errno); }
+
+  // Silence the log of the repeated operations
+  FILE* saved_log = log;
+  FILE* null_log = fopen("/dev/null", "w");
+  if (null_log != NULL) log = null_log;
+
+  // Images of the block are destroyed after each iteration: keep them
+  // out of the region of the request or frame, if any, so that they do
+  // not pile up there
+  ImageRegion region = ImageRegionUse(NULL);
+
+  int n0 = n;  // images before the block
+  // Runs of the operands: PREV and CURR before the block
+  double runs_in = 0.0;
+  for (int i = n0 >= 2 ? n0 - 2 : 0; i < n0; i++)
+    runs_in += (double)ImageNumRuns(img[i]);
+  int err = 0;
+  for (uint32 r = 0; r < warmup + runs && err == 0; r++) {
+    while (n > n0) dropImage();
+    double time = cpu_time();
+    for (int j = *k + 1; j < end && err == 0; j++) {
+      err = Operation(end, av, &j);  // operands must not go past end
+    }
+    time = cpu_time() - time;
+    if (r >= warmup) times[r - warmup] = time;
+  }
+
+  if (null_log != NULL) fclose(null_log);
+  log = saved_log;
+  ImageRegionUse(region);
+  *k = end;
+  if (err > 0) { free(times); return err; }
+
+  // Pixels processed per run: those of the images created, or of CURR
+  double pixels = 0.0;
+  for (int i = n0; i < n; i++)
+    pixels += (double)ImageWidth(img[i]) * ImageHeight(img[i]);
+  if (n == n0 && n > 0)
+    pixels = (double)ImageWidth(img[n-1]) * ImageHeight(img[n-1]);
+  // Runs processed per run: those of the operands and of the results
+  // (for in-place operations, CURR after the block)
+  double runs_out = 0.0;
+  for (int i = n0; i < n; i++) runs_out += (double)ImageNumRuns(img[i]);
+  if (n == n0 && n > 0) runs_out = (double)ImageNumRuns(img[n-1]);
+  double runs_total = runs_in + runs_out;
+
+  double total = 0.0;
+  for (uint32 r = 0; r < runs; r++) total += times[r];
+  qsort(times, runs, sizeof(double), cmpDouble);
+  double median = percentile(times, runs, 0.5);
+
+  fprintf(log, "Repeat(%u, warmup %u)\n", runs, warmup);
+  fprintf(log, "#%14.15s\t%15.15s\t%15.15s\t%15.15s\t%15.15s\t%15.15s\t%15.15s"
+          "\t%15.15s\n", "min", "median", "p90", "p99", "max", "pixels/s",
+          "runs/s", "iter/s");
+  fprintf(log, "%15.9f\t%15.9f\t%15.9f\t%15.9f\t%15.9f\t%15.0f\t%15.0f"
+          "\t%15.1f\n", times[0], median, percentile(times, runs, 0.9),
+          percentile(times, runs, 0.99), times[runs - 1],
+          median > 0.0 ? pixels / median : 0.0,
+          median > 0.0 ? runs_total / median : 0.0,
+          total > 0.0 ? runs / total : 0.0);
+
+  free(times);
+  return 0;
+}
+
+// Apply the operation named by av[*k] to the image buffer.
+// Operands are consumed by advancing *k to the last argument used.
+// Returns 0 on success, or an error code (index into errors[]).
+static int Operation(int ac, char* av[], int* k) {
+  uint32 w, h;
+
+  if (strcmp(av[*k], "info") == 0) {
+    if (n < 1) return 2;  // enough input images?
+    fprintf(log, "Info on I%d\n", n-1);
+    w = ImageWidth(img[n-1]);
+    h = ImageHeight(img[n-1]);
+    fprintf(log, "# Size: %ux%u\n", w, h);
+    fprintf(log, "# Memory: %zu bytes\n", ImageMemoryUsage(img[n-1]));
+    if (ImageTileWidth(img[n-1]) > 0) {
+      fprintf(log, "# Tile width: %u\n", ImageTileWidth(img[n-1]));
+    }
+  } else if (strcmp(av[*k], "tic") == 0) {
+    InstrReset();
+  } else if (strcmp(av[*k], "toc") == 0) {
+    InstrPrint();
+  } else if (strcmp(av[*k], "repeat") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    uint32 runs, warmup = 0;
+    if (sscanf(av[*k], "%u,%u", &runs, &warmup) < 1) return 4;
+    if (runs < 1) return 4;
+    int end = *k + 1;  // find matching end (no nesting)
+    while (end < ac && strcmp(av[end], "end") != 0) {
+      if (strcmp(av[end], "repeat") == 0) return 5;
+      end++;
+    }
+    if (end >= ac) return 5;
+    return Repeat(av, k, end, runs, warmup);
+  } else if (strcmp(av[*k], "end") == 0) {
+    return 5;  // end without repeat
+  } else if (strcmp(av[*k], "create") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    if (n >= N) return 3; // enough space for output?
+    uint32 c;  // color
+    if (sscanf(av[*k], "%u,%u,%u", &w, &h, &c) != 3) return 4;
+    if (!validSize(w, h) || c > 1) return 4;   // precondition check!
+    fprintf(log, "ImageCreate(%u, %u, %u) -> I%d\n", w, h, c, n);
+    img[n] = ImageCreate(w, h, (uint8)c);
+    //x if (img[n] == NULL) return 999;
+    n++;
+  } else if (strcmp(av[*k], "chess") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    if (n >= N) return 3; // enough space for output?
+    uint32 edge;  // square edge length
+    uint32 c;  // color
+    if (sscanf(av[*k], "%u,%u,%u,%u", &w, &h, &edge, &c) != 4) return 4;
+    if (!validSize(w, h) || edge == 0 || w % edge != 0 || h % edge != 0 ||
+        c > 1) return 4;   // precondition check!
+    fprintf(log, "ImageCreateChessBoard(%u, %u, %u, %u) -> I%d\n", w, h, edge, c, n);
+    img[n] = ImageCreateChessboard(w, h, edge, (uint8)c);
+    n++;
+  } else if (strcmp(av[*k], "gconst") == 0) {
+    if (++*k >= ac) return 1;
+    if (n >= N) return 3;
+    uint32 c;
+    if (sscanf(av[*k], "%u,%u,%u", &w, &h, &c) != 3) return 4;
+    if (!validSize(w, h) || c > 1) return 4;
+    fprintf(log, "ImageGenConstant(%u, %u, %u) -> I%d\n", w, h, c, n);
+    img[n] = ImageGenConstant(w, h, (uint8)c);
+    n++;
+  } else if (strcmp(av[*k], "gchess") == 0) {
+    if (++*k >= ac) return 1;
+    if (n >= N) return 3;
+    uint32 edge;
+    uint32 c;
+    if (sscanf(av[*k], "%u,%u,%u,%u", &w, &h, &edge, &c) != 4) return 4;
+    if (!validSize(w, h) || edge == 0 || c > 1) return 4;
+    fprintf(log, "ImageGenChessboard(%u, %u, %u, %u) -> I%d\n", w, h, edge, c, n);
+    img[n] = ImageGenChessboard(w, h, edge, (uint8)c);
+    n++;
+  } else if (strcmp(av[*k], "gstripes") == 0) {
+    if (++*k >= ac) return 1;
+    if (n >= N) return 3;
+    uint32 edge;
+    uint32 c;
+    uint32 v;
+    if (sscanf(av[*k], "%u,%u,%u,%u,%u", &w, &h, &edge, &c, &v) != 5) return 4;
+    if (!validSize(w, h) || edge == 0 || c > 1 || v > 1) return 4;
+    fprintf(log, "ImageGenStripes(%u, %u, %u, %u, %u) -> I%d\n", w, h, edge, c, v, n);
+    img[n] = ImageGenStripes(w, h, edge, (uint8)c, (int)v);
+    n++;
+  } else if (strcmp(av[*k], "ggrid") == 0) {
+    if (++*k >= ac) return 1;
+    if (n >= N) return 3;
+    uint32 spacing;
+    uint32 thickness;
+    if (sscanf(av[*k], "%u,%u,%u,%u", &w, &h, &spacing, &thickness) != 4) return 4;
+    if (!validSize(w, h) || spacing == 0) return 4;
+    fprintf(log, "ImageGenGrid(%u, %u, %u, %u) -> I%d\n", w, h, spacing, thickness, n);
+    img[n] = ImageGenGrid(w, h, spacing, thickness);
+    n++;
+  } else if (strcmp(av[*k], "grect") == 0) {
+    if (++*k >= ac) return 1;
+    if (n >= N) return 3;
+    uint32 x, y, rw, rh;
+    if (sscanf(av[*k], "%u,%u,%u,%u,%u,%u", &w, &h, &x, &y, &rw, &rh) != 6) return 4;
+    if (!validSize(w, h)) return 4;
+    fprintf(log, "ImageGenRectangle(%u, %u, %u, %u, %u, %u) -> I%d\n", w, h, x, y, rw, rh, n);
+    img[n] = ImageGenRectangle(w, h, x, y, rw, rh);
+    n++;
+  } else if (strcmp(av[*k], "raw") == 0) {
+    if (n < 1) return 2;  // enough input images?
+    fprintf(log, "ImageRAWPrint(I%d)\n", n-1);
+    ImageRAWPrint(img[n-1]);
+  } else if (strcmp(av[*k], "rle") == 0) {
+    if (n < 1) return 2;  // enough input images?
+    fprintf(log, "ImageRLEPrint(I%d)\n", n-1);
+    ImageRLEPrint(img[n-1]);
+  } else if (strcmp(av[*k], "equal") == 0) {
+    if (n < 2) return 2;  // enough input images?
+    fprintf(log, "ImageIsEqual(I%d, I%d) -> ", n-2, n-1);
+    int eq = ImageIsEqual(img[n-2], img[n-1]);
+    fprintf(log, "%d\n", eq);
+  } else if (strcmp(av[*k], "diff") == 0) {
+    if (n < 2) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    if (ImageWidth(img[n-2]) != ImageWidth(img[n-1]) ||
+        ImageHeight(img[n-2]) != ImageHeight(img[n-1])) {
+      fprintf(log, "# DIFFERENT SIZES: (%u, %u) (%u, %u)\n",
+              ImageWidth(img[n-2]), ImageHeight(img[n-2]),
+              ImageWidth(img[n-1]), ImageHeight(img[n-1]));
+      return 8;
+    }
+    h = ImageHeight(img[n-1]);
+    uint32* rows = malloc(h * sizeof(uint32));
+    if (rows == NULL) { perror("malloc"); exit(errno); }
+    fprintf(log, "ImageDiff(I%d, I%d) -> I%d\n", n-2, n-1, n);
+    ImageDiffResult d = ImageDiff(img[n-2], img[n-1], rows, &img[n]);
+    n++;
+    fprintf(log, "# Differing pixels: %" PRIu64 " (%.4f%%)\n", d.count, d.percent);
+    if (d.count > 0) {
+      differ = 1;
+      fprintf(log, "# Bounding box: (%u,%u)-(%u,%u)\n", d.xmin, d.ymin, d.xmax, d.ymax);
+      for (uint32 y = d.ymin; y <= d.ymax; y++)
+        if (rows[y] > 0) fprintf(log, "# Row %u: %u\n", y, rows[y]);
+    }
+    free(rows);
+  } else if (strcmp(av[*k], "find") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    if (n < 2) return 2;  // enough input images?
+    uint64 m;
+    if (sscanf(av[*k], "%" SCNu64, &m) != 1) return 4;
+    enum { SHOWN = 100 };  // positions listed
+    ImageMatch matches[SHOWN];
+    fprintf(log, "ImageFind(I%d, I%d, %" PRIu64 ") -> ", n-2, n-1, m);
+    uint64 count = ImageFind(img[n-2], img[n-1], m, matches, SHOWN);
+    fprintf(log, "%" PRIu64 "\n", count);
+    for (uint64 i = 0; i < count && i < SHOWN; i++) {
+      fprintf(log, "# Match at (%u,%u): %" PRIu64 " differing pixels\n",
+              matches[i].x, matches[i].y, matches[i].mismatch);
+    }
+    if (count > SHOWN) fprintf(log, "# (first %d shown)\n", SHOWN);
+  } else if (strcmp(av[*k], "neg") == 0) {
+    if (n < 1) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    fprintf(log, "ImageNEG(I%d) -> I%d\n", n-1, n);
+    img[n] = ImageNEG(img[n-1]);
+    n++;
+  } else if (strcmp(av[*k], "andmany") == 0 || strcmp(av[*k], "ormany") == 0 ||
+             strcmp(av[*k], "threshold") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    uint32 m, t;
+    if (strcmp(av[*k-1], "threshold") == 0) {
+      if (sscanf(av[*k], "%u,%u", &m, &t) != 2) return 4;
+    } else {
+      if (sscanf(av[*k], "%u", &m) != 1) return 4;
+      t = (av[*k-1][0] == 'a') ? m : 1;
+    }
+    if (m < 1 || t < 1 || t > m) return 4;   // precondition check!
+    if ((uint32)n < m) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    if (!sameSize((int)m)) return 8;
+    fprintf(log, "ImageThresholdCount(I%d..I%d, %u) -> I%d\n", n-(int)m, n-1, t, n);
+    img[n] = ImageThresholdCount(&img[n-m], m, t);
+    n++;
+  } else if (strcmp(av[*k], "neg!") == 0) {
+    if (n < 1) return 2;  // enough input images?
+    if (cached[n-1] != NULL) {  // borrowed from the cache: do not modify
+      Image result = ImageNEG(img[n-1]);
+      fprintf(log, "ImageNEG(I%d) -> I%d\n", n-1, n-1);
+      dropImage();
+      img[n++] = result;
+    } else {
+      fprintf(log, "ImageNEGInPlace(I%d)\n", n-1);
+      waitSaves(img[n-1]);
+      ImageNEGInPlace(img[n-1]);
+    }
+  } else if (strcmp(av[*k], "and!") == 0 || strcmp(av[*k], "or!") == 0 ||
+             strcmp(av[*k], "xor!") == 0) {
+    if (n < 2) return 2;  // enough input images?
+    const char* name;
+    void (*into)(Image, const Image, const Image);
+    Image (*op)(const Image, const Image);
+    if (av[*k][0] == 'a') {
+      name = "AND"; into = ImageANDInto; op = ImageAND;
+    } else if (av[*k][0] == 'o') {
+      name = "OR"; into = ImageORInto; op = ImageOR;
+    } else {
+      name = "XOR"; into = ImageXORInto; op = ImageXOR;
+    }
+    if (!sameSize(2)) return 8;
+    if (cached[n-1] != NULL) {  // borrowed from the cache: do not modify
+      Image result = op(img[n-2], img[n-1]);
+      fprintf(log, "Image%s(I%d, I%d) -> I%d\n", name, n-2, n-1, n-1);
+      dropImage();
+      img[n++] = result;
+    } else {
+      fprintf(log, "Image%sInto(I%d, I%d, I%d)\n", name, n-1, n-2, n-1);
+      waitSaves(img[n-1]);
+      into(img[n-1], img[n-2], img[n-1]);
+    }
+  } else if (strcmp(av[*k], "and") == 0) {
+    if (n < 2) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    if (!sameSize(2)) return 8;
+    fprintf(log, "ImageAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
+    img[n] = ImageAND(img[n-2], img[n-1]);
+    n++;
+  } else if (strcmp(av[*k], "or") == 0) {
+    if (n < 2) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    if (!sameSize(2)) return 8;
+    fprintf(log, "ImageOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+    img[n] = ImageOR(img[n-2], img[n-1]);
+    n++;
+  } else if (strcmp(av[*k], "xor") == 0) {
+    if (n < 2) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    if (!sameSize(2)) return 8;
+    fprintf(log, "ImageXOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+    img[n] = ImageXOR(img[n-2], img[n-1]);
+    n++;
+  } else if (binaryOp(av[*k]) >= 0 || strcmp(av[*k], "bool") == 0) {
+    unsigned op;
+    if (strcmp(av[*k], "bool") == 0) {
+      if (++*k >= ac) return 1;  // enough arguments?
+      if (sscanf(av[*k], "%u", &op) != 1 || op > 15) return 4;
+    } else {
+      op = (unsigned)binaryOp(av[*k]);
+    }
+    if (n < 2) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    if (!sameSize(2)) return 8;
+    fprintf(log, "ImageBinaryOp(I%d, I%d, 0x%X) -> I%d\n", n-2, n-1, op, n);
+    img[n] = ImageBinaryOp(img[n-2], img[n-1], op);
+    n++;
+  } else if (strcmp(av[*k], "tile") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    if (n < 1) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    uint32 tw;  // tile width
+    if (sscanf(av[*k], "%u", &tw) != 1) return 4;
+    fprintf(log, "ImageTile(I%d, %u) -> I%d\n", n-1, tw, n);
+    img[n] = ImageTile(img[n-1], tw);
+    n++;
+  } else if (strcmp(av[*k], "bitmap") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    if (n < 1) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    static const char* formats[] = { "msb", "lsb", "bytes", NULL };
+    int format;  // IMAGE_BITMAP_MSB, _LSB or _BYTES
+    for (format = 0; formats[format] != NULL; format++)
+      if (strcmp(av[*k], formats[format]) == 0) break;
+    if (formats[format] == NULL) return 4;
+    w = ImageWidth(img[n-1]);
+    h = ImageHeight(img[n-1]);
+    // Rows padded to a multiple of 4 bytes, as in BMP files
+    size_t stride = format == IMAGE_BITMAP_BYTES ? w : (w + 7) / 8;
+    stride = (stride + 3) / 4 * 4;
+    uint8* bitmap = malloc(stride * h);
+    if (bitmap == NULL) { perror("malloc"); exit(errno); }
+    fprintf(log, "ImageFromBitmap(ImageToBitmap(I%d, %s)) -> I%d\n", n-1,
+            formats[format], n);
+    ImageToBitmap(img[n-1], bitmap, stride, format);
+    img[n] = ImageFromBitmap(bitmap, w, h, stride, format);
+    free(bitmap);
+    n++;
+  } else if (strcmp(av[*k], "pixel") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    if (n < 1) return 2;  // enough input images?
+    uint32 x, y;
+    if (sscanf(av[*k], "%u,%u", &x, &y) != 2) return 4;
+    if (x >= ImageWidth(img[n-1]) ||
+        y >= ImageHeight(img[n-1])) return 4;
+    fprintf(log, "ImageGetPixel(I%d, %u, %u) -> %d\n", n-1, x, y,
+            ImageGetPixel(img[n-1], x, y));
+  } else if (strcmp(av[*k], "crop") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    if (n < 1) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    uint32 x, y;
+    if (sscanf(av[*k], "%u,%u,%u,%u", &x, &y, &w, &h) != 4) return 4;
+    if (w == 0 || h == 0 || x > ImageWidth(img[n-1]) ||
+        y > ImageHeight(img[n-1]) ||
+        w > ImageWidth(img[n-1]) - x ||
+        h > ImageHeight(img[n-1]) - y) return 4;
+    fprintf(log, "ImageCrop(I%d, %u, %u, %u, %u) -> I%d\n", n-1, x, y, w, h, n);
+    img[n] = ImageCrop(img[n-1], x, y, w, h);
+    n++;
+  } else if (strcmp(av[*k], "fill") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    if (n < 1) return 2;  // enough input images?
+    uint32 x, y, c;
+    if (sscanf(av[*k], "%u,%u,%u,%u,%u", &x, &y, &w, &h, &c) != 5) return 4;
+    if (c > 1 || x > ImageWidth(img[n-1]) ||
+        y > ImageHeight(img[n-1]) ||
+        w > ImageWidth(img[n-1]) - x ||
+        h > ImageHeight(img[n-1]) - y) return 4;
+    if (cached[n-1] != NULL) {  // borrowed from the cache: modify a copy
+      Image copy = ImageTile(img[n-1], ImageTileWidth(img[n-1]));
+      dropImage();
+      img[n++] = copy;
+    }
+    fprintf(log, "ImageFillRect(I%d, %u, %u, %u, %u, %u)\n", n-1, x, y, w, h, c);
+    waitSaves(img[n-1]);
+    ImageFillRect(img[n-1], x, y, w, h, (uint8)c);
+  } else if (strcmp(av[*k], "flood") == 0 || strcmp(av[*k], "holes") == 0) {
+    int flood = av[*k][0] == 'f';
+    uint32 x = 0, y = 0, c = 0;
+    if (flood) {
+      if (++*k >= ac) return 1;  // enough arguments?
+      if (n < 1) return 2;  // enough input images?
+      if (sscanf(av[*k], "%u,%u,%u", &x, &y, &c) != 3) return 4;
+      if (c > 1 || x >= ImageWidth(img[n-1]) ||
+          y >= ImageHeight(img[n-1])) return 4;
+    }
+    if (n < 1) return 2;  // enough input images?
+    if (cached[n-1] != NULL) {  // borrowed from the cache: modify a copy
+      Image copy = ImageTile(img[n-1], ImageTileWidth(img[n-1]));
+      dropImage();
+      img[n++] = copy;
+    }
+    waitSaves(img[n-1]);
+    if (flood) {
+      fprintf(log, "ImageFloodFill(I%d, %u, %u, %u)\n", n-1, x, y, c);
+      ImageFloodFill(img[n-1], x, y, (uint8)c);
+    } else {
+      fprintf(log, "ImageFillHoles(I%d)\n", n-1);
+      ImageFillHoles(img[n-1]);
+    }
+  } else if (strcmp(av[*k], "hmirror") == 0) {
+    if (n < 1) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
+    img[n] = ImageHorizontalMirror(img[n-1]);
+    n++;
+  } else if (strcmp(av[*k], "vmirror") == 0) {
+    if (n < 1) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
+    img[n] = ImageHorizontalMirror(img[n-1]);
+    n++;
+  } else if (strcmp(av[*k], "repb") == 0) {
+    if (n < 2) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    if (ImageWidth(img[n-2]) != ImageWidth(img[n-1])) return 8;
+    fprintf(log, "ImageReplicateAtBottom(I%d, I%d) -> I%d\n", n-2, n-1, n);
+    img[n] = ImageReplicateAtBottom(img[n-2], img[n-1]);
+    n++;
+  } else if (strcmp(av[*k], "repr") == 0) {
+    if (n < 2) return 2;  // enough input images?
+    if (n >= N) return 3; // enough space for output?
+    if (ImageHeight(img[n-2]) != ImageHeight(img[n-1])) return 8;
+    fprintf(log, "ImageReplicateAtRight(I%d, I%d) -> I%d\n", n-2, n-1, n);
+    img[n] = ImageReplicateAtRight(img[n-2], img[n-1]);
+    n++;
+  } else if (strcmp(av[*k], "send") == 0) {
+    if (!serving) return 7;
+    if (n < 1) return 2;  // enough input images?
+    fprintf(log, "ImageSaveToMemory(I%d) -> client\n", n-1);
+    // Encode to memory first, to announce the size
+    size_t size = ImageSaveToMemory(img[n-1], NULL, 0);
+    char* buf = malloc(size);
+    if (buf == NULL) { perror("malloc"); exit(errno); }
+    ImageSaveToMemory(img[n-1], buf, size);
+    fprintf(log, "#PBM %zu\n", size);
+    fflush(log);
+    fwrite(buf, 1, size, log);
+    free(buf);
+  } else if (strcmp(av[*k], "quit") == 0) {
+    if (!serving) return 7;
+    quitting = 1;
+  } else if (strcmp(av[*k], "save") == 0) {
+    if (++*k >= ac) return 1;
+    if (n < 1) return 2;  // enough input images?
+    if (isStdio(av[*k])) {
+      if (serving) return 4;  // stdout is the client log: use send
+      fprintf(log, "ImageSaveStream(I%d, stdout)\n", n-1);
+    } else if (isRLEFile(av[*k])) {
+      fprintf(log, "ImageSaveRLE(I%d, \"%s\")\n", n-1, av[*k]);
+    } else if (isG4File(av[*k])) {
+      fprintf(log, "ImageSaveG4(I%d, \"%s\")\n", n-1, av[*k]);
+    } else {
+      fprintf(log, "ImageSave(I%d, \"%s\")\n", n-1, av[*k]);
+    }
+    Job job = {av[*k], 0, 0, img[n-1], -1};
+    if (background) queueSave(img[n-1], av[*k]);
+    else if (!runJob(saveJob, &job)) return 6;
+  } else if (strcmp(av[*k], "psave") == 0) {
+    if (++*k >= ac) return 1;
+    if (n < 1) return 2;  // enough input images?
+    int t;
+    if (sscanf(av[*k], "%d", &t) != 1 || t < 0) return 4;
+    if (++*k >= ac) return 1;
+    if (isStdio(av[*k])) return 4;  // positioned writes need a file
+    fprintf(log, "ImageSaveParallel(I%d, \"%s\", %d)\n", n-1, av[*k], t);
+    waitSaves(NULL);  // earlier saves may write the same file
+    Job job = {av[*k], 0, 0, img[n-1], t};
+    if (!runJob(saveJob, &job)) return 6;
+  } else if (strcmp(av[*k], "loadrows") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    if (n >= N) return 3; // enough space for output?
+    uint32 y;
+    if (sscanf(av[*k], "%u,%u", &y, &h) != 2 || h == 0) return 4;
+    if (++*k >= ac) return 1;
+    fprintf(log, "ImageLoadRLERows(\"%s\", %u, %u) -> I%d\n", av[*k], y, h, n);
+    waitSaves(NULL);  // the file may be written by an earlier save
+    Job probe = {av[*k], y, h, NULL, 0};
+    if (serving && !runJob(loadJob, &probe)) return 6;
+    img[n] = ImageLoadRLERows(av[*k], y, h);
+    n++;
+  } else if (strcmp(av[*k], "checkrle") == 0) {
+    if (++*k >= ac) return 1;  // enough arguments?
+    waitSaves(NULL);
+    Job job = {av[*k], 0, 0, NULL, 0};
+    if (!runJob(checkRLEJob, &job)) return 6;
+  } else if (isStdio(av[*k])) {  // next image of stdin, or of the client
+    if (n >= N) return 3;
+    if (serving) {
+      fprintf(log, "ImageLoadFromMemory(client) -> I%d\n", n);
+      img[n] = recvImage();
+    } else {
+      fprintf(log, "ImageLoadStream(stdin) -> I%d\n", n);
+      img[n] = ImageLoadStream(stdin);
+    }
+    if (img[n] == NULL) return 6;
+    n++;
+  } else if (serving) {  // image file, through the cache
+    if (n >= N) return 3;
+    int hit;
+    CacheEntry* e = cacheLoad(av[*k], &hit);
+    if (e == NULL) return 6;
+    fprintf(log, "ImageLoad(\"%s\") -> I%d%s\n", av[*k], n, hit ? " (cached)" : "");
+    img[n] = e->img;
+    cached[n] = e;
+    n++;
+  } else {  // image file (maybe prefetched)
+    if (n >= N) return 3;
+    if (isRLEFile(av[*k])) {  // native RLE file
+      fprintf(log, "ImageLoadRLE(\"%s\") -> I%d\n", av[*k], n);
+    } else if (isG4File(av[*k])) {  // Group 4 TIFF file
+      fprintf(log, "ImageLoadG4(\"%s\") -> I%d\n", av[*k], n);
+    } else {
+      fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[*k], n);
+    }
+    img[n] = takePrefetched(*k);
+    if (img[n] == NULL) {
+      waitSaves(NULL);  // the file may be written by an earlier save
+      img[n] = loadFile(av[*k]);
+    }
+    //x if (img[n] == NULL) return 999;
+    n++;
+  }
+  return 0;
+}
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations,
@@ -84,142 +1320,308 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
+// Read one request from conn: arguments terminated by NUL, ending with an
+// empty argument.  Fills av[1..] (av[0] is unused, as in main).
+// Returns the number of arguments + 1, or -1 on error.
+// *bufp is (re)allocated to hold the argument strings, followed by the
+// *extra_lenp bytes read past them, at *extrap.
+static int readRequest(int conn, char** bufp, char*** avp, char** extrap,
+                       size_t* extra_lenp) {
+  size_t cap = 4096;
+  size_t len = 0;
+  size_t scanned = 0;  // bytes already checked for the end of request
+  char* buf = malloc(cap);
+  if (buf == NULL) { perror("malloc"); exit(errno); }
+  // Read until an empty argument: "\0\0", or a lone "\0" at the start
+  for (;;) {
+    if (len == cap) {
+      cap *= 2;
+      if ((buf = realloc(buf, cap)) == NULL) { perror("realloc"); exit(errno); }
+    }
+    ssize_t got = read(conn, buf + len, cap - len);
+    if (got <= 0) { free(buf); return -1; }
+    len += (size_t)got;
+    if (buf[0] == '\0') { scanned = 1; break; }
+    int done = 0;
+    for (; scanned < len && !done; scanned++)
+      done = (scanned > 0 && buf[scanned] == '\0' && buf[scanned-1] == '\0');
+    if (done) break;
+  }
+  *extrap = buf + scanned;  // just past the empty argument
+  *extra_lenp = len - scanned;
+
+  int ac = 1;
+  for (size_t i = 0; i < len && buf[i] != '\0'; i += strlen(buf + i) + 1) ac++;
+  char** av = malloc((ac + 1) * sizeof(char*));
+  if (av == NULL) { perror("malloc"); exit(errno); }
+  av[0] = "serve";
+  size_t i = 0;
+  for (int a = 1; a < ac; a++) {
+    av[a] = buf + i;
+    i += strlen(buf + i) + 1;
+  }
+  av[ac] = NULL;
+  *bufp = buf;
+  *avp = av;
+  return ac;
+}
+
+// Run one pipeline request on connection conn.
+// Everything the operations print to stdout is sent to the client.
+static void handleRequest(int conn) {
+  char* buf;
+  char** av;
+  int ac = readRequest(conn, &buf, &av, &req_extra, &req_extra_len);
+  if (ac < 0) return;
+  req_conn = conn;
+
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  dup2(conn, STDOUT_FILENO);
+
+  // All images of the request are released at once at the end
+  ImageRegion region = ImageRegionBegin();
+  int err = 0;
+  int k = 1;
+  while (k < ac) {
+    err = Operation(ac, av, &k);
+    if (err > 0) break;
+    k++;
+  }
+  while (n > 0) dropImage();
+  ImageRegionEnd(&region);
+  fprintf(log, "#END %d %s\n", err, errors[err]);
+
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  req_conn = -1;
+  req_extra = NULL;
+  req_extra_len = 0;
+  free(av);
+  free(buf);
+}
+
+// Serve pipeline requests on a Unix domain socket, until a quit request.
+static int Serve(const char* spec) {
+  char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  unsigned mb;
+  const char* comma = strrchr(spec, ',');
+  if (comma != NULL && sscanf(comma + 1, "%u", &mb) == 1) {
+    cache_capacity = (size_t)mb << 20;
+  } else {
+    comma = spec + strlen(spec);
+  }
+  if ((size_t)(comma - spec) >= sizeof(path)) {
+    fprintf(stderr, "Socket path too long\n");
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%.*s", (int)(comma - spec), spec);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) { perror("socket"); return 1; }
+  unlink(path);
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(sock, 16) != 0) {
+    perror(path);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);  // a client leaving early must not kill us
+  serving = 1;
+  fprintf(stderr, "Serving on %s\n", path);
+
+  while (!quitting) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      break;
+    }
+    handleRequest(conn);
+    close(conn);
+  }
+
+  close(sock);
+  unlink(path);
+  while (cache_head != NULL) cacheRemove(cache_head);
+  return 0;
+}
+
+// Apply the pipeline av[4..ac) to every frame of the PBM stream av[2],
+// writing CURR of each run to the PBM stream av[3].
+static int Frames(int ac, char* av[]) {
+  FILE* in = isStdio(av[2]) ? stdin : fopen(av[2], "rb");
+  if (in == NULL) { perror(av[2]); return 1; }
+  FILE* out = isStdio(av[3]) ? stdout : fopen(av[3], "wb");
+  if (out == NULL) { perror(av[3]); return 1; }
+  if (out == stdout) log = stderr;  // keep the log out of the images
+
+  int err = 0;
+  int frame = 0;
+  Image image;
+  ImageRegion region = ImageRegionBegin();  // one per frame
+  while (err == 0 && (image = ImageLoadStream(in)) != NULL) {
+    fprintf(log, "ImageLoadStream(\"%s\") -> I0  # frame %d\n", av[2], frame);
+    img[n++] = image;
+    for (int k = 4; k < ac && err == 0; k++) {
+      err = Operation(ac, av, &k);
+    }
+    if (err == 0) {
+      fprintf(log, "ImageSaveStream(I%d, \"%s\")\n", n-1, av[3]);
+      ImageSaveStream(img[n-1], out);
+    }
+    while (n > 0) dropImage();
+    ImageRegionEnd(&region);
+    region = ImageRegionBegin();
+    frame++;
+  }
+  ImageRegionEnd(&region);
+
+  if (in != stdin) fclose(in);
+  if ((out == stdout ? fflush(out) : fclose(out)) != 0) {
+    perror(av[3]);
+    return 1;
+  }
+  if (err > 0) {
+    fprintf(stderr, "%s\n", errors[err]);
+    return 100 + err;
+  }
+  return differ;
+}
+
+// Index mode: add the images av[3..] to the index file av[2].
+static int Index(int ac, char* av[]) {
+  ImageIndex index = ImageIndexOpen(av[2]);
+  for (int k = 3; k < ac; k++) {
+    if (isStdio(av[k])) {  // indexed images are loaded again by name
+      fprintf(stderr, "%s\n", errors[4]);
+      ImageIndexClose(&index);
+      return 104;
+    }
+    ImageRegion region = ImageRegionBegin();
+    Image image = loadFile(av[k]);
+    fprintf(log, "ImageIndexAdd(\"%s\", \"%s\") -> %u\n", av[2], av[k],
+            ImageIndexAdd(index, av[k], image));
+    ImageRegionEnd(&region);
+  }
+  ImageIndexClose(&index);
+  return 0;
+}
+
+// Query mode: show the K entries of the index file av[2] nearest to the
+// image av[4] (av[3] is K[,S]).
+static int Query(char* av[]) {
+  uint32 k;
+  double s = 0.0;
+  char c;
+  if ((sscanf(av[3], "%u%c", &k, &c) != 1 &&
+       (sscanf(av[3], "%u,%lf%c", &k, &s, &c) != 2 || s < 0 || s > 100)) ||
+      k == 0) {
+    fprintf(stderr, "%s\n", errors[4]);
+    return 104;
+  }
+  ImageIndex index = ImageIndexOpen(av[2]);
+  Image query = loadFile(av[4]);
+  if (query == NULL) {
+    fprintf(stderr, "%s\n", errors[6]);
+    ImageIndexClose(&index);
+    return 106;
+  }
+  ImageIndexMatch* matches = malloc(k * sizeof(ImageIndexMatch));
+  if (matches == NULL) { perror("malloc"); exit(errno); }
+  uint32 verified;
+  uint32 found = ImageIndexQuery(index, query, k, s / 100, loadFile, matches,
+                                 &verified);
+  fprintf(log, "ImageIndexQuery(\"%s\", \"%s\", %u, %g%%) -> %u"
+          "  # %u of %u entries verified\n", av[2], av[4], k, s, found,
+          verified, ImageIndexSize(index));
+  double pixels = (double)ImageWidth(query) * ImageHeight(query);
+  for (uint32 i = 0; i < found; i++) {
+    fprintf(log, "# %u: %s  %" PRIu64 " differing pixels (%.4f%%),"
+            " similarity %.2f\n", i + 1,
+            ImageIndexName(index, matches[i].entry), matches[i].distance,
+            100.0 * (double)matches[i].distance / pixels,
+            matches[i].similarity);
+  }
+  free(matches);
+  ImageDestroy(&query);
+  ImageIndexClose(&index);
+  return 0;
+}
+
 int main(int ac, char* av[]) {
   if (ac <= 1) {
     fprintf(stderr, "\n%s", USAGE);
     return 1;
   }
   
-  FILE *log = stdout;   // where to send log messages
+  log = stdout;
 
   ImageInit();
 
-  int err = 0;
-  uint32 w, h;
+  if (strcmp(av[1], "serve") == 0) {
+    if (ac != 3) {
+      fprintf(stderr, "\n%s", USAGE);
+      return 1;
+    }
+    return Serve(av[2]);
+  }
+  if (strcmp(av[1], "frames") == 0) {
+    if (ac < 4) {
+      fprintf(stderr, "\n%s", USAGE);
+      return 1;
+    }
+    return Frames(ac, av);
+  }
+  if (strcmp(av[1], "index") == 0) {
+    if (ac < 3) {
+      fprintf(stderr, "\n%s", USAGE);
+      return 1;
+    }
+    return Index(ac, av);
+  }
+  if (strcmp(av[1], "query") == 0) {
+    if (ac != 5) {
+      fprintf(stderr, "\n%s", USAGE);
+      return 1;
+    }
+    return Query(av);
+  }
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];       // the images
-  int n = 0;          // number of images created
+  // Keep the log out of images saved to the standard output
+  for (int k = 1; k + 1 < ac; k++) {
+    if (strcmp(av[k], "save") == 0 && isStdio(av[k+1])) log = stderr;
+  }
 
+  int err = 0;
+
+  // Images are not allocated in a region (unlike frames and requests):
+  // in-place operations must free the rows they replace, or memory would
+  // grow with the length of the pipeline.
+  startBackgroundIO(ac, av);
   int k = 1;
   while (k < ac) {
-    if (strcmp(av[k], "info") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "Info on I%d\n", n-1);
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      fprintf(log, "# Size: %ux%u\n", w, h);
-    } else if (strcmp(av[k], "tic") == 0) {
-      InstrReset();
-    } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
-    } else if (strcmp(av[k], "create") == 0) {
-      if (++k >= ac) { err = 1; break; }  // enough arguments?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      uint32 c;  // color
-      if (sscanf(av[k], "%u,%u,%u", &w, &h, &c) != 3) { err = 4; break; }
-      if (c > 1) { err = 4; break; }   // precondition check!
-      fprintf(log, "ImageCreate(%u, %u, %u) -> I%d\n", w, h, c, n);
-      img[n] = ImageCreate(w, h, (uint8)c);
-      //x if (img[n] == NULL) { err = 999; break; }
-      n++;
-    } else if (strcmp(av[k], "chess") == 0) {
-      if (++k >= ac) { err = 1; break; }  // enough arguments?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      uint32 edge;  // square edge length
-      uint32 c;  // color
-      if (sscanf(av[k], "%u,%u,%u,%u", &w, &h, &edge, &c) != 4) { err = 4; break; }
-      if (c > 1) { err = 4; break; }   // precondition check!
-      fprintf(log, "ImageCreateChessBoard(%u, %u, %u, %u) -> I%d\n", w, h, edge, c, n);
-      img[n] = ImageCreateChessboard(w, h, edge, (uint8)c);;
-      n++;
-    } else if (strcmp(av[k], "raw") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageRAWPrint(I%d)\n", n-1);
-      ImageRAWPrint(img[n-1]);
-    } else if (strcmp(av[k], "rle") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageRLEPrint(I%d)\n", n-1);
-      ImageRLEPrint(img[n-1]);
-    } else if (strcmp(av[k], "equal") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageIsEqual(I%d, I%d) -> ", n-2, n-1);
-      int eq = ImageIsEqual(img[n-2], img[n-1]);
-      fprintf(log, "%d\n", eq);
-    } else if (strcmp(av[k], "neg") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageNEG(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageNEG(img[n-1]);
-      n++;
-    } else if (strcmp(av[k], "and") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageAND(img[n-2], img[n-1]);
-      n++;
-    } else if (strcmp(av[k], "or") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageOR(img[n-2], img[n-1]);
-      n++;
-    } else if (strcmp(av[k], "xor") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageXOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageXOR(img[n-2], img[n-1]);
-      n++;
-    } else if (strcmp(av[k], "hmirror") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageHorizontalMirror(img[n-1]);
-      n++;
-    } else if (strcmp(av[k], "vmirror") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageHorizontalMirror(img[n-1]);
-      n++;
-    } else if (strcmp(av[k], "repb") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageReplicateAtBottom(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageReplicateAtBottom(img[n-2], img[n-1]);
-      n++;
-    } else if (strcmp(av[k], "repr") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageReplicateAtRight(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageReplicateAtRight(img[n-2], img[n-1]);
-      n++;
-    } else if (strcmp(av[k], "save") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageSave(I%d, \"%s\")\n", n-1, av[k]);
-      ImageSave(img[n-1], av[k]);
-    } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      //x if (img[n] == NULL) { err = 999; break; }
-      n++;
-    }
+    err = Operation(ac, av, &k);
+    if (err > 0) break;
     k++;
   }
+  stopBackgroundIO();
   
   // Destroy remaining images
   while (n > 0) {
     fprintf(log, "ImageDestroy(I%d)\n", n-1);
-    ImageDestroy(&img[--n]);
+    dropImage();
   }
 
   if (err > 0) {
     fprintf(stderr, "%s\n", errors[err]);
     exit(100 + err);
   }
-  return 0;
+  return differ;
 }
 
@@ -0,0 +1,279 @@
+/// imageIndex - Near-duplicate search over a corpus of BW images
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "imageIndex.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An index file is a header followed by one record per entry:
+//
+//   header   IndexFileHeader
+//   records  ImageSignature, uint32 name length, name (no NUL)
+//
+// Records are only ever appended.  As RLE files, index files use the
+// byte order of the machine that wrote them; the header also records
+// the size of the signatures, so that files written with other
+// signature parameters are rejected.
+//
+// The whole index is kept in memory: the signatures in one array, which
+// queries scan, and the names in another one (NUL-terminated).
+
+#define INDEX_MAGIC "AEDIDX1\n"
+#define INDEX_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[8];        // INDEX_MAGIC
+  uint32 byte_order;    // INDEX_BYTE_ORDER, as written
+  uint32 sig_size;      // sizeof(ImageSignature)
+} IndexFileHeader;
+
+struct imageIndex {
+  char* filename;
+  FILE* out;             // open for appending, once an entry is added
+  uint32 size;           // number of entries
+  uint32 capacity;       // room in sigs and name_pos
+  ImageSignature* sigs;  // signature of each entry
+  size_t* name_pos;      // start of the name of each entry in names
+  char* names;           // the names, NUL-terminated
+  size_t names_size;
+  size_t names_capacity;
+};
+
+/// Error handling functions
+
+// As in imageBW, functions dealing with memory allocation or file (I/O)
+// operations fail fast: they print an error and exit the program.
+
+// Check a condition and if false, print failmsg and exit.
+static void check(int condition, const char* failmsg) {
+  if (!condition) {
+    perror(failmsg);
+    exit(errno || 255);
+  }
+}
+
+// realloc that exits on failure.
+static void* Realloc(void* p, size_t size) {
+  p = realloc(p, size);
+  check(p != NULL, "realloc");
+  return p;
+}
+
+// Append an entry to the index in memory.
+static void AppendEntry(ImageIndex index, const ImageSignature* sig,
+                        const char* name, size_t name_len) {
+  if (index->size == index->capacity) {
+    check(index->capacity < UINT32_MAX / 2, "Index too large");
+    index->capacity = index->capacity == 0 ? 64 : 2 * index->capacity;
+    index->sigs = Realloc(index->sigs,
+                          index->capacity * sizeof(ImageSignature));
+    index->name_pos = Realloc(index->name_pos,
+                              index->capacity * sizeof(size_t));
+  }
+  while (index->names_size + name_len + 1 > index->names_capacity) {
+    index->names_capacity =
+        index->names_capacity == 0 ? 4096 : 2 * index->names_capacity;
+    index->names = Realloc(index->names, index->names_capacity);
+  }
+  index->sigs[index->size] = *sig;
+  index->name_pos[index->size] = index->names_size;
+  memcpy(index->names + index->names_size, name, name_len);
+  index->names[index->names_size + name_len] = '\0';
+  index->names_size += name_len + 1;
+  index->size++;
+}
+
+/// Open the index file filename, or start a new one if it does not exist
+/// (the file is created by the first ImageIndexAdd).
+/// On failure (invalid or truncated file, I/O error), EXITS program!
+/// (The caller is responsible for closing the returned index!)
+ImageIndex ImageIndexOpen(const char* filename) {  ///
+  assert(filename != NULL);
+  ImageIndex index = calloc(1, sizeof(*index));
+  check(index != NULL, "calloc");
+  index->filename = strdup(filename);
+  check(index->filename != NULL, "strdup");
+
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    check(errno == ENOENT, "Open failed");
+    return index;  // a new index
+  }
+  IndexFileHeader header;
+  check(fread(&header, sizeof(header), 1, f) == 1 &&
+        memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+        header.byte_order == INDEX_BYTE_ORDER &&
+        header.sig_size == sizeof(ImageSignature),
+        "Invalid file format");
+
+  ImageSignature sig;
+  char* name = NULL;
+  while (fread(&sig, sizeof(sig), 1, f) == 1) {
+    uint32 name_len;
+    check(fread(&name_len, sizeof(name_len), 1, f) == 1,
+          "Invalid or truncated file");
+    name = Realloc(name, (size_t)name_len + 1);
+    check(fread(name, 1, name_len, f) == name_len,
+          "Invalid or truncated file");
+    check(sig.width > 0 && sig.height > 0, "Invalid index entry");
+    AppendEntry(index, &sig, name, name_len);
+  }
+  check(feof(f), "Reading index failed");
+  free(name);
+  fclose(f);
+  return index;
+}
+
+/// Close an index, writing any pending entries.
+/// Ensures: (*indexp)==NULL.
+/// On failure, does not return, EXITS program!
+void ImageIndexClose(ImageIndex* indexp) {  ///
+  assert(indexp != NULL);
+  ImageIndex index = *indexp;
+  if (index == NULL) return;
+  if (index->out != NULL) {
+    check(fclose(index->out) == 0, "Closing file failed");
+  }
+  free(index->filename);
+  free(index->sigs);
+  free(index->name_pos);
+  free(index->names);
+  free(index);
+  *indexp = NULL;
+}
+
+/// Add img to the index, under name, and append it to the file.
+/// Returns the number of the new entry (entries are numbered from 0).
+/// On failure, does not return, EXITS program!
+uint32 ImageIndexAdd(ImageIndex index, const char* name, const Image img) {  ///
+  assert(index != NULL && name != NULL && img != NULL);
+  size_t name_len = strlen(name);
+  check(name_len <= UINT32_MAX, "Name too long");
+
+  if (index->out == NULL) {
+    check((index->out = fopen(index->filename, "ab")) != NULL &&
+          fseek(index->out, 0, SEEK_END) == 0, "Open failed");
+    if (ftell(index->out) == 0) {  // a new file
+      IndexFileHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+      header.byte_order = INDEX_BYTE_ORDER;
+      header.sig_size = sizeof(ImageSignature);
+      check(fwrite(&header, sizeof(header), 1, index->out) == 1,
+            "Writing header failed");
+    }
+  }
+
+  ImageSignature sig;
+  ImageComputeSignature(img, &sig);
+  uint32 len = (uint32)name_len;
+  check(fwrite(&sig, sizeof(sig), 1, index->out) == 1 &&
+        fwrite(&len, sizeof(len), 1, index->out) == 1 &&
+        fwrite(name, 1, name_len, index->out) == name_len,
+        "Writing entry failed");
+  AppendEntry(index, &sig, name, name_len);
+  return index->size - 1;
+}
+
+/// Number of entries of the index.
+uint32 ImageIndexSize(const ImageIndex index) {  ///
+  assert(index != NULL);
+  return index->size;
+}
+
+/// Name of entry e of the index.
+const char* ImageIndexName(const ImageIndex index, uint32 e) {  ///
+  assert(index != NULL && e < index->size);
+  return index->names + index->name_pos[e];
+}
+
+/// Signature of entry e of the index.
+const ImageSignature* ImageIndexSignature(const ImageIndex index, uint32 e) {  ///
+  assert(index != NULL && e < index->size);
+  return &index->sigs[e];
+}
+
+/// Queries
+
+// An entry that may be among the nearest, with its lower bound.
+typedef struct {
+  uint64 lower;
+  uint32 entry;
+  double similarity;
+} Candidate;
+
+static int CompareCandidates(const void* p1, const void* p2) {
+  const Candidate* c1 = p1;
+  const Candidate* c2 = p2;
+  if (c1->lower != c2->lower) return c1->lower < c2->lower ? -1 : 1;
+  return c1->entry < c2->entry ? -1 : c1->entry > c2->entry;
+}
+
+// Does match a go before match b (nearer, or as near with a lower entry)?
+static int Nearer(const ImageIndexMatch* a, const ImageIndexMatch* b) {
+  return a->distance < b->distance ||
+         (a->distance == b->distance && a->entry < b->entry);
+}
+
+/// Find the (up to) k entries nearest to query, by ImageDistance, and
+/// store them in matches, nearest first (ties by entry number).
+/// Entries whose signature similarity to that of query is below
+/// min_similarity are skipped (0 finds the exact k nearest).
+/// The candidates are loaded with load and compared in increasing order
+/// of ImageSignatureLowerBound, until no other one can be nearer.
+/// If verifiedp is not NULL, *verifiedp receives the number compared.
+/// Returns the number of matches stored.
+uint32 ImageIndexQuery(const ImageIndex index, const Image query, uint32 k,
+                       double min_similarity, ImageIndexLoader load,
+                       ImageIndexMatch* matches, uint32* verifiedp) {  ///
+  assert(index != NULL && query != NULL && load != NULL);
+  assert(k == 0 || matches != NULL);
+  ImageSignature sig;
+  ImageComputeSignature(query, &sig);
+
+  // Scan the signatures
+  Candidate* cand = malloc((index->size + 1) * sizeof(Candidate));
+  check(cand != NULL, "malloc");
+  uint32 n = 0;
+  for (uint32 e = 0; e < index->size; e++) {
+    double similarity = ImageSignatureSimilarity(&sig, &index->sigs[e]);
+    if (similarity < min_similarity) continue;
+    cand[n].lower = ImageSignatureLowerBound(&sig, &index->sigs[e]);
+    cand[n].entry = e;
+    cand[n].similarity = similarity;
+    n++;
+  }
+  qsort(cand, n, sizeof(Candidate), CompareCandidates);
+
+  // Verify them, keeping the k nearest in matches (sorted)
+  uint32 found = 0;
+  uint32 verified = 0;
+  for (uint32 c = 0; c < n && k > 0; c++) {
+    // The others are no nearer than the farthest match
+    if (found == k && cand[c].lower > matches[k - 1].distance) break;
+    uint64 limit = found == k ? matches[k - 1].distance : UINT64_MAX;
+    Image img = load(ImageIndexName(index, cand[c].entry));
+    check(img != NULL, "Loading indexed image failed");
+    ImageIndexMatch m = {cand[c].entry, ImageDistance(query, img, limit),
+                         cand[c].similarity};
+    ImageDestroy(&img);
+    verified++;
+    if (found == k && !Nearer(&m, &matches[k - 1])) continue;
+    uint32 i = found < k ? found++ : k - 1;
+    for (; i > 0 && Nearer(&m, &matches[i - 1]); i--) matches[i] = matches[i - 1];
+    matches[i] = m;
+  }
+
+  free(cand);
+  if (verifiedp != NULL) *verifiedp = verified;
+  return found;
+}
@@ -0,0 +1,70 @@
+/// imageIndex - Near-duplicate search over a corpus of BW images
+///
+/// An index file holds the signature (see ImageComputeSignature) and the
+/// name of each image of a corpus.  Queries rank the indexed images by
+/// their signatures and verify the best ones on the images themselves,
+/// with ImageDistance, to find the k nearest ones exactly.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef IMAGEINDEX_H
+#define IMAGEINDEX_H
+
+#include "imageBW.h"
+
+// Type ImageIndex is a pointer to open index files
+typedef struct imageIndex* ImageIndex;
+
+// Functions that load an image by the name it was indexed with
+// (for verification).  The image is destroyed after use.
+typedef Image (*ImageIndexLoader)(const char* name);
+
+/// Open the index file filename, or start a new one if it does not exist
+/// (the file is created by the first ImageIndexAdd).
+/// On failure (invalid or truncated file, I/O error), EXITS program!
+/// (The caller is responsible for closing the returned index!)
+ImageIndex ImageIndexOpen(const char* filename);
+
+/// Close an index, writing any pending entries.
+/// Ensures: (*indexp)==NULL.
+/// On failure, does not return, EXITS program!
+void ImageIndexClose(ImageIndex* indexp);
+
+/// Add img to the index, under name, and append it to the file.
+/// Returns the number of the new entry (entries are numbered from 0).
+/// On failure, does not return, EXITS program!
+uint32 ImageIndexAdd(ImageIndex index, const char* name, const Image img);
+
+/// Number of entries of the index.
+uint32 ImageIndexSize(const ImageIndex index);
+
+/// Name of entry e of the index.
+const char* ImageIndexName(const ImageIndex index, uint32 e);
+
+/// Signature of entry e of the index.
+const ImageSignature* ImageIndexSignature(const ImageIndex index, uint32 e);
+
+/// A result of ImageIndexQuery
+typedef struct {
+  uint32 entry;       // entry number
+  uint64 distance;    // differing pixels (ImageDistance)
+  double similarity;  // ImageSignatureSimilarity
+} ImageIndexMatch;
+
+/// Find the (up to) k entries nearest to query, by ImageDistance, and
+/// store them in matches, nearest first (ties by entry number).
+/// Entries whose signature similarity to that of query is below
+/// min_similarity are skipped (0 finds the exact k nearest).
+/// The candidates are loaded with load and compared in increasing order
+/// of ImageSignatureLowerBound, until no other one can be nearer.
+/// If verifiedp is not NULL, *verifiedp receives the number compared.
+/// Returns the number of matches stored.
+uint32 ImageIndexQuery(const ImageIndex index, const Image query, uint32 k,
+                       double min_similarity, ImageIndexLoader load,
+                       ImageIndexMatch* matches, uint32* verifiedp);
+
+#endif
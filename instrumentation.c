@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU or read it from env var
+/// InstrCalibrate();  // Optional, InstrPrint calls it if needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -22,6 +22,11 @@
 #include "instrumentation.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -68,8 +73,8 @@ double cpu_time(void) {
 
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one per thread):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -82,31 +87,134 @@ double InstrTime;  ///extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
+/// Is InstrCTU already set (by calibration, env var or cache file)?
+int InstrCalibrated = 0;  ///extern
+
+// Get a short description of the CPU model, to key the calibration cache.
+// Writes at most size-1 chars to model.
+static void cpu_model(char* model, size_t size) {
+  snprintf(model, size, "unknown");
+#if defined(__linux__)
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    // x86 uses "model name", some ARM kernels only give "Hardware"
+    if (strncmp(line, "model name", 10) == 0 || strncmp(line, "Hardware", 8) == 0) {
+      char* val = strchr(line, ':');
+      if (val == NULL) continue;
+      val += strspn(val, ": \t");
+      val[strcspn(val, "\n")] = '\0';
+      snprintf(model, size, "%s", val);
+      break;
+    }
+  }
+  fclose(f);
+#elif defined(__APPLE__)
+  size_t len = size;
+  if (sysctlbyname("machdep.cpu.brand_string", model, &len, NULL, 0) != 0)
+    snprintf(model, size, "unknown");
+#endif
+}
+
+// Get the name of the calibration cache file.
+// Uses INSTRCACHE if defined, otherwise a file in the user's cache dir.
+// Returns 0 if no suitable name was found.
+static int cache_filename(char* name, size_t size) {
+  char *val = getenv("INSTRCACHE");
+  if (val != NULL) {
+    snprintf(name, size, "%s", val);
+    return *val != '\0';  // INSTRCACHE= disables the cache
+  }
+  if ((val = getenv("XDG_CACHE_HOME")) != NULL && *val != '\0') {
+    snprintf(name, size, "%s/instrctu", val);
+    return 1;
+  }
+  if ((val = getenv("HOME")) != NULL && *val != '\0') {
+    snprintf(name, size, "%s/.cache/instrctu", val);
+    return 1;
+  }
+  return 0;
+}
+
+// Look for the CTU of this CPU model in the cache file.
+// Each line holds a CTU value followed by the CPU model it applies to.
+static int cache_read(const char* filename, const char* model, double* ctu) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) return 0;
+  char line[512];
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    char* rest;
+    double val = strtod(line, &rest);
+    if (rest == line || *rest != ' ') continue;
+    rest[1 + strcspn(rest + 1, "\n")] = '\0';
+    if (strcmp(rest + 1, model) == 0 && val > 0.0) {
+      *ctu = val;
+      found = 1;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+// Append the CTU of this CPU model to the cache file (errors are ignored).
+static void cache_write(const char* filename, const char* model, double ctu) {
+  FILE* f = fopen(filename, "a");
+  if (f == NULL) {
+    // Maybe the cache directory does not exist yet: try to create it.
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", filename);
+    char* slash = strrchr(dir, '/');
+    if (slash == NULL || slash == dir) return;
+    *slash = '\0';
+    mkdir(dir, 0755);
+    if ((f = fopen(filename, "a")) == NULL) return;
+  }
+  fprintf(f, "%.6f %s\n", ctu, model);
+  fclose(f);
+}
+
+// Run and time the calibration loop.
+static double calibration_loop(void) {
+  const int size = 4*1024;     // 2^12!
+  const int mask = size - 1;
+  int array[size];  // alloc array in stack, not initialized on purpose
+  double time = cpu_time();
+  srand((unsigned int)(time*1e9));
+  for (int n = 0; n < 40000000; n++) {
+    int i = rand() & mask;
+    int j = rand() & mask;
+    int k = rand() & mask;
+    array[k] ^= array[i] + array[j] + i*j;
+    //printf("%d %d %d\n", i, j, k);  // debug
+  }
+  return cpu_time() - time;
+}
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
 /// If environment variable INSTRCTU is defined, get CTU from there
 /// and bypass the calibration loop entirely.
+/// Otherwise, reuse the value cached for this CPU model, if any,
+/// and cache the result of a new calibration.
 void InstrCalibrate(void) { ///
   char *val = getenv("INSTRCTU");
   if (val != NULL) {
     InstrCTU = atof(val);
   }
   else {
-    const int size = 4*1024;     // 2^12!
-    const int mask = size - 1;
-    int array[size];  // alloc array in stack, not initialized on purpose
-    double time = cpu_time();
-    srand((unsigned int)(time*1e9));
-    for (int n = 0; n < 40000000; n++) {
-      int i = rand() & mask;
-      int j = rand() & mask;
-      int k = rand() & mask;
-      array[k] ^= array[i] + array[j] + i*j;
-      //printf("%d %d %d\n", i, j, k);  // debug
+    char model[256];
+    char filename[512];
+    cpu_model(model, sizeof(model));
+    int cache = cache_filename(filename, sizeof(filename));
+    if (!(cache && cache_read(filename, model, &InstrCTU))) {
+      InstrCTU = calibration_loop();
+      if (cache) cache_write(filename, model, InstrCTU);
     }
-    InstrCTU = cpu_time() - time;
   }
+  InstrCalibrated = 1;
   printf("# export INSTRCTU=%.3f  # (To bypass calibration)\n", InstrCTU);
 }
 
@@ -121,6 +229,8 @@ void InstrReset(void) { ///
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  // calibrate only now, when the calibrated time is needed
+  if (!InstrCalibrated) InstrCalibrate();
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
 
@@ -12,7 +12,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU or read it from env var
+/// InstrCalibrate();  // Optional, InstrPrint calls it if needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -29,7 +29,21 @@ double cpu_time(void) ; ///
 #define NUMCOUNTERS 10
 
 /// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// (Each thread has its own counters, so that threads do not race on them;
+/// InstrReset and InstrPrint act on those of the calling thread.)
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
+
+/// Add n to counter k.
+/// If NINSTR is defined when compiling (like NDEBUG for assert),
+/// counting compiles to nothing at all, and n is not even evaluated
+/// (only its type is checked, so that variables it uses are not unused).
+/// Counts in inner loops are best summed in a local variable and added
+/// once, after the loop: the loop then never touches the counters.
+#ifdef NINSTR
+#define InstrAdd(k, n) ((void)sizeof(n))
+#else
+#define InstrAdd(k, n) ((void)(InstrCount[k] += (n)))
+#endif
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -40,16 +54,25 @@ extern double InstrTime;  ///extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
 
+/// Is InstrCTU already set? (InstrPrint calibrates lazily if not)
+extern int InstrCalibrated;  ///extern
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
 /// If environment variable INSTRCTU is defined, get CTU from there
 /// and bypass the calibration loop entirely.
+/// Otherwise, the CTU is cached per CPU model in the file named by
+/// INSTRCACHE (default: $XDG_CACHE_HOME/instrctu or ~/.cache/instrctu)
+/// and only measured when that file has no value for this CPU.
+/// Set INSTRCACHE to an empty string to disable the cache.
 void InstrCalibrate(void) ;
 
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print times and all named counter values.
+/// Calls InstrCalibrate first, if that was not done yet.
 void InstrPrint(void) ;
 
 #endif
@@ -0,0 +1,153 @@
+# Operation-count regression check for imageBWTool.
+# Usage: python3 perfCheck.py [--update] [--tolerance T] BASELINE
+#
+# Runs a fixed matrix of operations on synthetic images, each between
+# "tic" and "toc", and compares the instrumentation counters (pixmem,
+# allocs, ...) against the values recorded in the BASELINE file.
+# Counters are deterministic, unlike times, so the check does not depend
+# on the machine.  Fails if any counter grows by more than the tolerance
+# (a fraction, default 0.05).  With --update, rewrites BASELINE instead.
+#
+# BASELINE has one line per case and counter:  CASE COUNTER VALUE
+
+import os
+import subprocess
+import sys
+
+TOOL = "./imageBWTool"
+TMP = "perfcheck.tmp"  # prefix of temporary files
+
+# (case name, setup operations, measured operations)
+MATRIX = [
+    ("chess",      [],                                  ["chess 2000,2000,8,0"]),
+    ("create",     [],                                  ["create 2000,2000,1"]),
+    ("neg",        ["chess 2000,2000,8,0"],             ["neg"]),
+    ("neg!",       ["chess 2000,2000,8,0"],             ["neg!"]),
+    ("and",        ["chess 2000,2000,8,0", "chess 2000,2000,5,1"], ["and"]),
+    ("or",         ["chess 2000,2000,8,0", "chess 2000,2000,5,1"], ["or"]),
+    ("xor",        ["chess 2000,2000,8,0", "chess 2000,2000,5,1"], ["xor"]),
+    ("andnot",     ["chess 2000,2000,8,0", "chess 2000,2000,5,1"], ["andnot"]),
+    ("xor!",       ["chess 2000,2000,8,0", "chess 2000,2000,5,1"], ["xor!"]),
+    ("andmany",    ["chess 1000,1000,4,0", "chess 1000,1000,5,1",
+                    "chess 1000,1000,8,0"],             ["andmany 3"]),
+    ("threshold",  ["chess 1000,1000,4,0", "chess 1000,1000,5,1",
+                    "chess 1000,1000,8,0"],             ["threshold 3,2"]),
+    ("equal",      ["chess 2000,2000,8,0", "chess 2000,2000,8,0"], ["equal"]),
+    ("diff",       ["chess 2000,2000,8,0", "chess 2000,2000,5,0"], ["diff"]),
+    ("repb",       ["chess 1000,1000,8,0", "chess 1000,500,5,1"], ["repb"]),
+    ("gchess",     ["gchess 2000,2000,8,0"],            ["neg"]),
+    ("ggrid",      ["ggrid 2000,2000,100,3"],           ["neg"]),
+    ("tile",       ["chess 4000,480,8,0"],              ["tile 256"]),
+    ("tiled-and",  ["chess 4000,480,8,0", "tile 256",
+                    "chess 4000,480,5,1", "tile 256"],  ["and"]),
+    ("crop",       ["chess 2000,2000,8,0"],             ["crop 500,500,1000,1000"]),
+    ("fill",       ["chess 2000,2000,8,0"],             ["fill 500,500,1000,1000,1"]),
+    ("flood",      ["ggrid 2000,2000,50,3"],            ["flood 0,0,0"]),
+    ("holes",      ["ggrid 2000,2000,50,3"],            ["holes"]),
+    ("find",       ["ggrid 2000,2000,97,3", "fill 500,500,60,40,1",
+                    "crop 490,490,80,60"],              ["find 10"]),
+    ("bitmap",     ["chess 2000,2000,8,0"],             ["bitmap msb"]),
+    ("bitmap-bytes", ["chess 2000,2000,8,0"],           ["bitmap bytes"]),
+    ("pixel",      ["chess 2000,2000,8,0"],             ["pixel 1999,1999"]),
+    ("save-pbm",   ["chess 2000,2000,8,0"],             ["save " + TMP + ".pbm"]),
+    ("load-pbm",   ["chess 2000,2000,8,0", "save " + TMP + ".pbm"],
+                                                        [TMP + ".pbm"]),
+    ("psave-pbm",  ["chess 2000,2000,8,0"],             ["psave 3 " + TMP + ".pbm"]),
+    ("save-rle",   ["chess 2000,2000,8,0"],             ["save " + TMP + ".rle"]),
+    ("load-rle",   ["chess 2000,2000,8,0", "save " + TMP + ".rle"],
+                                                        [TMP + ".rle"]),
+    ("save-g4",    ["chess 2000,2000,8,0"],             ["save " + TMP + ".tif"]),
+    ("load-g4",    ["chess 2000,2000,8,0", "save " + TMP + ".tif"],
+                                                        [TMP + ".tif"]),
+]
+
+
+def counters(setup, ops):
+    """Run setup, then ops between tic and toc, and return the counters."""
+    args = [TOOL]
+    for op in setup + ["tic"] + ops + ["toc"]:
+        args += op.split()
+    env = dict(os.environ, INSTRCTU="1")
+    run = subprocess.run(args, env=env, capture_output=True, text=True)
+    if run.returncode not in (0, 1):  # 1: diff found differing pixels
+        raise subprocess.CalledProcessError(run.returncode, args)
+    out = run.stdout.splitlines()
+    for i, line in enumerate(out):
+        names = line.lstrip("#").split()
+        if names[:2] == ["time", "caltime"]:
+            values = out[i + 1].split()
+            return dict(zip(names[2:], map(int, values[2:])))
+    raise RuntimeError("no counters in output of " + " ".join(args))
+
+
+def measure():
+    """Run the whole matrix; return a dict {(case, counter): value}."""
+    result = {}
+    try:
+        for case, setup, ops in MATRIX:
+            for name, value in counters(setup, ops).items():
+                result[case, name] = value
+    finally:
+        for ext in (".pbm", ".rle", ".tif"):
+            if os.path.exists(TMP + ext):
+                os.remove(TMP + ext)
+    return result
+
+
+def read_baseline(filename):
+    baseline = {}
+    with open(filename) as f:
+        for line in f:
+            if line.strip() == "" or line.startswith("#"):
+                continue
+            case, name, value = line.split()
+            baseline[case, name] = int(value)
+    return baseline
+
+
+def write_baseline(filename, result):
+    with open(filename, "w") as f:
+        f.write("# Operation counts of perfCheck.py (CASE COUNTER VALUE).\n")
+        f.write("# Regenerate with:  make perfbaseline\n")
+        for (case, name), value in result.items():
+            f.write(f"{case} {name} {value}\n")
+
+
+def main(args):
+    update = "--update" in args
+    tolerance = 0.05
+    if "--tolerance" in args:
+        tolerance = float(args[args.index("--tolerance") + 1])
+    files = [a for i, a in enumerate(args[1:], 1)
+             if not a.startswith("--") and args[i - 1] != "--tolerance"]
+    if len(files) != 1:
+        print(f"python3 {args[0]} [--update] [--tolerance T] BASELINE")
+        return 1
+
+    result = measure()
+    if update:
+        write_baseline(files[0], result)
+        print(f"{len(result)} counters written to {files[0]}")
+        return 0
+
+    baseline = read_baseline(files[0])
+    failed = 0
+    for key in sorted(baseline.keys() | result.keys()):
+        case, name = key
+        if key not in result:
+            print(f"MISSING  {case} {name}")
+            failed += 1
+        elif key not in baseline:
+            print(f"NEW      {case} {name} {result[key]} (not in baseline)")
+        elif result[key] > baseline[key] * (1 + tolerance):
+            print(f"WORSE    {case} {name} {baseline[key]} -> {result[key]}")
+            failed += 1
+        elif result[key] < baseline[key]:
+            print(f"better   {case} {name} {baseline[key]} -> {result[key]}")
+    print(f"{len(result)} counters checked, {failed} regressions"
+          f" (tolerance {tolerance:.0%})")
+    return failed != 0
+
+
+if __name__ == "__main__":
+    exit(main(sys.argv))